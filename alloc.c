@@ -1,10 +1,40 @@
+#if defined(ALLOC_TRACE) && !defined(_POSIX_C_SOURCE)
+	#define _POSIX_C_SOURCE 199309L
+#endif
+
+// Large nodes get pages of their own from mmap on Linux, where mremap can
+// resize them (see alloc_set_mmap_threshold). -DALLOC_NO_MMAP turns this off.
+#if defined(__linux__) && !defined(ALLOC_NO_MMAP)
+	#define ALLOC_MMAP
+	#ifndef _GNU_SOURCE
+		#define _GNU_SOURCE	// for mremap
+	#endif
+#endif
+
+#ifndef ALLOC_MMAP_THRESHOLD
+	#define ALLOC_MMAP_THRESHOLD ((size_t)1 << 20)
+#endif
+
 #include "alloc.h"
+#include "hashmap.h"	// for hashmap_hash, which interning shares
 #include <memory.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
 #include <stdio.h>
 
+#ifdef ALLOC_TRACE
+	#include <time.h>
+#endif
+
+#ifdef ALLOC_MMAP
+	#include <sys/mman.h>
+#endif
+
+#ifdef ALLOC_RECORD
+	#include "alloc_record.h"
+#endif
+
 #define ALLOC_DATA(node) ((void*)((char*)(node) + sizeof(alloc_node)))
 #define ADJUST_OFFSET(ptr, offset) ((void*)((char*)(ptr) + (offset)))
 
@@ -14,23 +44,143 @@ typedef struct alloc_node {
 	struct alloc_node *left;
 	struct alloc_node *right;
 	struct alloc_ptr *ptr_list;
+	const struct alloc_type *type;	// see alloc_new_typed, NULL for nodes that use ptr_list
 	//struct alloc_weak_ptr *weak_ptr_list;
 	size_t ref_count;
+	uint32_t flags;
 	size_t size;
 } alloc_node;
 
+#define NODE_READ_ONLY 1		// loaded from a snapshot of an interned node, see alloc_is_shared
+#define NODE_MAPPED 2			// the node is its own mapping, see malloc_node
+#define NODE_SNAPSHOT 4			// reached while collecting nodes for a snapshot
+#define NODE_INTERNED 8			// in the intern table, see alloc_intern
+#define NODE_ZEROED 16			// its user zeroes untracked alloc_ptrs, see alloc_keep_zeroed
+#define READ_BLOCK_SIZE ((size_t)1 << 20)	// for files whose size is not known up front
+#define INTERN_MIN_CAPACITY 64
+
+// Loops over the alloc_ptrs that a typed node's layout puts between start_pos
+// and end_pos of its data, setting ptr to each one in turn. size is the node's
+// size, passed separately as gc adds max_usage_max to it while marking.
+#define FOR_EACH_TYPED_PTR(ptr, node, size, start_pos, end_pos)												\
+	for(size_t element_pos_ = (start_pos) / (node)->type->stride * (node)->type->stride;						\
+		element_pos_ < (end_pos) && element_pos_ + (node)->type->stride <= (size);								\
+		element_pos_ += (node)->type->stride)																	\
+		for(size_t field_ = 0; field_ < (node)->type->ptr_count; field_++)										\
+			if((ptr) = (alloc_ptr*)((char*)ALLOC_DATA(node) + element_pos_ + (node)->type->ptr_offsets[field_]),	\
+				(char*)(ptr) >= (char*)ALLOC_DATA(node) + (start_pos) && (char*)(ptr) < (char*)ALLOC_DATA(node) + (end_pos))
+
+// A snapshot file is SNAPSHOT_MAGIC followed by unsigned LEB128 varints as in
+// alloc_record.h: the node count, the total of their sizes, the total count
+// of alloc_ptrs in them, the root's node and the root's size after its
+// alloc_ptr, then those bytes of the root. Each node follows with its size,
+// flags and alloc_ptr count, the offset and node of each of its alloc_ptrs
+// in increasing order, then its data with those alloc_ptrs zeroed. Nodes are
+// numbered from 1 in file order, 0 standing for NULL.
+#define SNAPSHOT_MAGIC "ALLOCSN1"
+#define SNAPSHOT_MAGIC_SIZE 8
+
 static size_t max_usage_max = SIZE_MAX / 2;
 static size_t max_usage = SIZE_MAX / 2;
 static size_t memory_usage = 0;
+static size_t peak_memory_usage = 0;
+static size_t allocation_count = 0;
+static size_t gc_count = 0;
+
+#ifdef ALLOC_MMAP
+static size_t mmap_threshold = ALLOC_MMAP_THRESHOLD;
+#endif
 
 static alloc_ptr end_ptr = { 0 };
 
-static alloc_node allocations = { NULL, NULL, NULL, NULL, 1, 0 };
+static alloc_node allocations = { NULL, NULL, NULL, NULL, NULL, 1, 0, 0 };
 static alloc_frame global_frame = { 0 };
 static alloc_frame *current_frame = &global_frame;
 
+// The roots linked with alloc_link_root, between two sentinels so that every
+// linked root has both a next and a prev.
+static alloc_root roots;
+static alloc_root roots_end = { { NULL, NULL }, &roots };
+static alloc_root roots = { { &roots_end.ptr, NULL }, NULL };
+
+// The nodes made by alloc_intern, by the hash of their data, with linear
+// probing. Entries hold no reference: free_node takes nodes out as they go,
+// and the table itself is freed once it is empty.
+typedef struct intern_entry {
+	alloc_node *node;	// NULL for empty entries
+	uint64_t hash;
+} intern_entry;
+
+static intern_entry *intern_entries = NULL;
+static size_t intern_capacity = 0;	// a power of two, or 0 without a table
+static size_t intern_count = 0;
+
+
+// Tracing is opt-in at compile time (-DALLOC_TRACE). When it is compiled out,
+// TRACE expands to nothing, so the hooks below cost nothing.
+#ifdef ALLOC_TRACE
+
+#ifndef ALLOC_TRACE_CAPACITY
+	#define ALLOC_TRACE_CAPACITY 65536	// must be a power of two
+#endif
+
+typedef enum trace_type {
+	TRACE_NEW,
+	TRACE_RESIZE,
+	TRACE_FREE,
+	TRACE_BEGIN,
+	TRACE_END,
+	TRACE_GC_BEGIN,
+	TRACE_GC_END
+} trace_type;
+
+typedef struct trace_event {
+	uint64_t timestamp;		// nanoseconds, CLOCK_MONOTONIC
+	const void *ptr;		// the node, or the frame's filename for BEGIN/END
+	size_t value;			// the node size, or the frame's line number for BEGIN/END
+	size_t memory_usage;
+	unsigned char type;
+} trace_event;
+
+// The allocator's state is process-wide and not thread-safe, so one preallocated
+// ring buffer serves the single thread using it. Old events are overwritten.
+static trace_event trace_events[ALLOC_TRACE_CAPACITY];
+static size_t trace_count = 0;
+
+static void trace(trace_type type, const void *ptr, size_t value);
+static void write_json_string(FILE *file, const char *string);
+
+#define TRACE(type, ptr, value) trace((type), (ptr), (value))
+#else
+#define TRACE(type, ptr, value) ((void)0)
+#endif
+
+
+// Recording is opt-in at compile time (-DALLOC_RECORD) and runs between
+// alloc_record_start and alloc_record_stop. See alloc_record.h for the format.
+#ifdef ALLOC_RECORD
+
+static FILE *record_file = NULL;
+
+static void record_uint(uint64_t value);
+static void record_ref(alloc_ptr *ptr);
+static void record_type(const alloc_type *type);
+
+#define RECORD(...) do { if(record_file) { __VA_ARGS__; } } while(0)
+#else
+#define RECORD(...) ((void)0)
+#endif
+
+static void end_frame();
+static alloc_node* create_node(size_t size);
+static alloc_node* create_typed_node(const alloc_type *type, size_t size);
+static void gc();
 static void assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr);
+static void track_ptr(alloc_ptr *ptr);
 
+static void release_ptrs(alloc_node *node, size_t start_pos, size_t end_pos);
+static BOOL holds_ptrs(alloc_node *node, size_t start_pos, size_t end_pos);
+static void init_typed_ptrs(alloc_node *node, size_t start_pos, size_t end_pos);
 static alloc_ptr *remove_ptrs(alloc_ptr *ptr_list, char *data, size_t start_pos, size_t end_pos);
 static alloc_ptr *adjust_next_ptrs(alloc_ptr *ptr_list, ptrdiff_t offset);
 static void adjust_node_ptrs(alloc_ptr *ptr_list, alloc_node *old_node, alloc_node *new_node);
@@ -39,18 +189,40 @@ static void adjust_node_tree_node_ptrs(alloc_node *parent, alloc_node *old_node,
 static alloc_ptr *find_prev_ptr(alloc_ptr *ptr_list, alloc_ptr *current_ptr);
 
 static void decrement_list_ref_count(alloc_ptr *ptr);
+static void release_frame_ptrs(alloc_ptr *ptr);
 static void decrement_ref_count(alloc_ptr *ptr);
 
 static alloc_node* malloc_node(size_t size);
+#ifdef ALLOC_MMAP
+static alloc_node* remap_node(alloc_node *node, size_t new_size);
+#endif
 static void free_node(alloc_node *node);
 
 static void mark_nodes(alloc_ptr *ptr_list);
+static void mark_node(alloc_node *node);
 static void gc_nodes(alloc_node *parent);
 static void unmark_nodes(alloc_node *parent);
+static size_t root_usage();
+static size_t unmark_held_nodes(alloc_node *parent);
 
 static void add_alloc_node(alloc_node *parent, alloc_node *node);
+static void add_alloc_nodes(alloc_node **nodes, size_t count);
 static void remove_alloc_node(alloc_node *node);
 static alloc_node* find_alloc_node(alloc_ptr *contains);
+static size_t list_alloc_nodes(alloc_node *root, alloc_node **nodes);
+static alloc_node* build_alloc_tree(alloc_node **nodes, size_t count, alloc_node *parent);
+
+static alloc_node* find_interned(const void *data, size_t size, uint64_t hash);
+static BOOL add_interned(alloc_node *node, uint64_t hash);
+static void remove_interned(alloc_node *node);
+
+static alloc_node** collect_nodes(alloc_node *root, size_t *count);
+static BOOL collect_node(alloc_node ***nodes, size_t *count, size_t *capacity, alloc_node *node);
+static size_t list_node_ptrs(alloc_node *node, alloc_ptr **ptrs);
+static uint64_t snapshot_index(alloc_node **nodes, size_t count, alloc_node *node);
+static int compare_addresses(const void *a, const void *b);
+static void write_uint(FILE *file, uint64_t value);
+static BOOL read_uint(FILE *file, uint64_t *value);
 
 static void alloc_ptr_list_debug_info(alloc_ptr *ptr_list);
 static void alloc_node_tree_debug_info(alloc_node *node, int depth);
@@ -66,29 +238,45 @@ void alloc_begin(alloc_frame *frame, const char *filename, size_t line_number) {
 	frame->filename = filename;
 	frame->line_number = line_number;
 	current_frame = frame;
+
+	RECORD(record_uint(RECORD_BEGIN));
+	TRACE(TRACE_BEGIN, filename, line_number);
 }
 
 
 void alloc_end() {
+	RECORD(record_uint(RECORD_END));
+	end_frame();
+}
+
+
+void end_frame() {
 	assert(current_frame != NULL);
 	assert(current_frame->next_frame != NULL);
 
-	decrement_list_ref_count(current_frame->ptr_list);
+	TRACE(TRACE_END, current_frame->filename, current_frame->line_number);
+
+	release_frame_ptrs(current_frame->ptr_list);
 	current_frame = current_frame->next_frame;
 
 	if(current_frame == &global_frame) {
 		decrement_list_ref_count(current_frame->ptr_list);
-		
-		if(memory_usage > 0) {
-			printf("\n\n%d BYTES OF UNFREED MEMORY\n\n", (int)memory_usage);
+
+		// roots may outlive the outermost frame, so what they hold is not unfreed
+		size_t unfreed = memory_usage - root_usage();
+
+		if(unfreed > 0) {
+			printf("\n\n%d BYTES OF UNFREED MEMORY\n\n", (int)unfreed);
 		}
 
-		if(allocations.left || allocations.right) {
+		if(unfreed > 0 && (allocations.left || allocations.right)) {
 			puts("\n\nUNFREED MEMORY AT PROGRAM EXIT");
 			puts("------------------------------");
 			alloc_node_tree_debug_info(&allocations, 0);
 			puts("------------------------------");
 		}
+
+		RECORD(fflush(record_file));
 	}
 }
 
@@ -101,7 +289,11 @@ void* alloc_return(alloc_ptr *ptr, size_t size) {
 	alloc_frame *next_frame = current_frame->next_frame;
 	alloc_ptr *return_ptr = &next_frame->return_value.ptr;
 
-	ptr->node->ref_count++;
+	RECORD(record_uint(RECORD_RETURN); record_ref(ptr); record_uint(ptr ? (uintptr_t)ptr->node : 0); record_uint(size));
+
+	if(ptr && ptr->node)
+		ptr->node->ref_count++;
+
 	decrement_ref_count(return_ptr);
 	
 	if(ptr)
@@ -111,7 +303,7 @@ void* alloc_return(alloc_ptr *ptr, size_t size) {
 
 	return_ptr->next = NULL;
 	
-	alloc_end();
+	end_frame();
 	return &next_frame->return_value;
 }
 
@@ -121,16 +313,52 @@ void* alloc_return_new(size_t size) {
 
 	alloc_ptr *ptr = &current_frame->return_value.ptr;
 	decrement_ref_count(ptr);
-	ptr->node = alloc_new(size);
+	ptr->node = create_node(size);
 
-	if(ptr->node)
+	RECORD(record_uint(RECORD_RETURN_NEW); record_uint(size); record_uint((uintptr_t)ptr->node));
+
+	if(ptr->node || size == 0)
 		return ptr;
 	else
 		return NULL;
 }
 
 
+void* alloc_return_new_typed(const alloc_type *type, size_t size) {
+	assert(current_frame != NULL);
+
+	alloc_ptr *ptr = &current_frame->return_value.ptr;
+	decrement_ref_count(ptr);
+	ptr->node = create_typed_node(type, size);
+
+	RECORD(record_uint(RECORD_RETURN_NEW_TYPED); record_type(type); record_uint(size); record_uint((uintptr_t)ptr->node));
+	return ptr;
+}
+
+
+BOOL alloc_is_pending_return(alloc_ptr *ptr) {
+	assert(current_frame != NULL);
+	return ptr == &current_frame->return_value.ptr;
+}
+
+
 struct alloc_node* alloc_new(size_t size) {
+	alloc_node *node = create_node(size);
+
+	RECORD(record_uint(RECORD_NEW); record_uint(size); record_uint((uintptr_t)node));
+	return node;
+}
+
+
+struct alloc_node* alloc_new_typed(const alloc_type *type, size_t size) {
+	alloc_node *node = create_typed_node(type, size);
+
+	RECORD(record_uint(RECORD_NEW_TYPED); record_type(type); record_uint(size); record_uint((uintptr_t)node));
+	return node;
+}
+
+
+alloc_node* create_node(size_t size) {
 	assert(allocations.parent == NULL);
 	assert(allocations.size == 0);
 	assert(end_ptr.next == NULL);
@@ -146,9 +374,31 @@ struct alloc_node* alloc_new(size_t size) {
 	node->right = NULL;
 
 	node->ptr_list = &end_ptr;
+	node->type = NULL;
 	node->ref_count = 1;
 	node->size = size;
 
+	TRACE(TRACE_NEW, node, size);
+	return node;
+}
+
+
+alloc_node* create_typed_node(const alloc_type *type, size_t size) {
+	assert(type != NULL && type->stride > 0);
+	assert(size % type->stride == 0);
+
+	for(size_t i = 0; i < type->ptr_count; i++) {
+		assert(type->ptr_offsets[i] % sizeof(void*) == 0 && type->ptr_offsets[i] + sizeof(alloc_ptr) <= type->stride);
+		assert(i == 0 || type->ptr_offsets[i] >= type->ptr_offsets[i - 1] + sizeof(alloc_ptr));
+	}
+
+	alloc_node *node = create_node(size);
+
+	if(node) {
+		node->type = type;
+		init_typed_ptrs(node, 0, size);
+	}
+
 	return node;
 }
 
@@ -156,36 +406,69 @@ struct alloc_node* alloc_new(size_t size) {
 struct alloc_node* alloc_resize(struct alloc_node *node, size_t new_size) {
 	assert(current_frame != NULL);
 
-	if(!node)
-		return alloc_new(new_size);
+	if(!node) {
+		alloc_node *new_node = create_node(new_size);
+
+		RECORD(record_uint(RECORD_RESIZE); record_uint(0); record_uint(new_size); record_uint((uintptr_t)new_node));
+		return new_node;
+	}
 
 	size_t old_size = node->size;
+	BOOL remap = FALSE;
+	alloc_node *new_node = NULL;
+
+	assert(!node->type || new_size % node->type->stride == 0);
+	assert(!(node->flags & NODE_INTERNED));
+
+#ifdef ALLOC_MMAP
+	// a shrink that drops alloc_ptrs copies instead, so that they are only
+	// released once the new node exists
+	remap = (node->flags & NODE_MAPPED) && new_size >= mmap_threshold
+		&& (new_size >= old_size || !holds_ptrs(node, new_size, old_size));
 
-	alloc_node *new_node = malloc_node(new_size);
+	if(remap)
+		new_node = remap_node(node, new_size);
+#endif
+
+	if(!remap)
+		new_node = malloc_node(new_size);
+
+	RECORD(record_uint(RECORD_RESIZE); record_uint((uintptr_t)node); record_uint(new_size); record_uint((uintptr_t)new_node));
 
 	if(new_size > 0 && !new_node)
 		return NULL;
 
 
-	if(new_size > 0) {
+	if(remap) {
+		// remap_node has already moved the node and taken it out of the tree
+	} else if(new_size > 0) {
 		assert(new_node != NULL);
 
 		ptrdiff_t offset = (char*)new_node - (char*)node;
+		uint32_t mapped = new_node->flags & NODE_MAPPED;
 
 		if(new_size < old_size)
-			node->ptr_list = remove_ptrs(node->ptr_list, ALLOC_DATA(node), new_size, old_size);
+			release_ptrs(node, new_size, old_size);
 
 		node->ptr_list = adjust_next_ptrs(node->ptr_list, offset);
 
 		memcpy(new_node, node, sizeof(alloc_node) + (new_size < old_size ? new_size : old_size));
+		new_node->flags = (new_node->flags & ~NODE_MAPPED) | mapped;
 		new_node->size = new_size;
 		new_node->left = NULL;
 		new_node->right = NULL;
 	} else {
 		assert(new_node == NULL);
-		decrement_list_ref_count(node->ptr_list);
+
+		if(node->type)
+			release_ptrs(node, 0, old_size);
+		else
+			decrement_list_ref_count(node->ptr_list);
 	}
 
+	if(new_node && new_node->type && new_size > old_size)
+		init_typed_ptrs(new_node, old_size, new_size);
+
 	
 	alloc_frame *frame = current_frame;
 
@@ -194,16 +477,26 @@ struct alloc_node* alloc_resize(struct alloc_node *node, size_t new_size) {
 		frame = frame->next_frame;
 	}
 
+	adjust_node_ptrs(roots.ptr.next, node, new_node);
 
-	if(new_node) {	
-		remove_alloc_node(node);
+
+	TRACE(TRACE_RESIZE, new_node, new_size);
+
+	if(remap) {
+		// remap_node has already taken the node out of the tree, and new_node is
+		// the same mapping moved, so there is nothing to free
 		adjust_node_tree_node_ptrs(&allocations, node, new_node);
 		add_alloc_node(&allocations, new_node);
 	} else {
+		remove_alloc_node(node);
 		adjust_node_tree_node_ptrs(&allocations, node, new_node);
+
+		if(new_node)
+			add_alloc_node(&allocations, new_node);
+
+		free_node(node);
 	}
 
-	free_node(node);
 	return new_node;
 }
 
@@ -228,52 +521,74 @@ size_t alloc_size(alloc_ptr *ptr) {
 }
 
 
+void alloc_set_node(alloc_ptr *ptr, struct alloc_node *node) {
+	assert(ptr != NULL);
+
+	RECORD(record_uint(RECORD_SET_NODE); record_ref(ptr); record_uint((uintptr_t)node));
+	ptr->node = node;
+}
+
+
 void alloc_init(alloc_ptr *ptr, size_t size) {
 	assert(current_frame != NULL);
 
 	ptr->next = current_frame->ptr_list;
-	ptr->node = alloc_new(size);
+	ptr->node = create_node(size);
 	current_frame->ptr_list = ptr;
+
+	RECORD(record_uint(RECORD_INIT); record_ref(ptr); record_uint(size); record_uint((uintptr_t)ptr->node));
 }
 
 
-void alloc_assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr) {
+void alloc_init_typed(alloc_ptr *ptr, const alloc_type *type, size_t size) {
+	assert(current_frame != NULL);
 
-	assign(to_ptr, from_ptr);
+	ptr->next = current_frame->ptr_list;
+	ptr->node = create_typed_node(type, size);
+	current_frame->ptr_list = ptr;
 
-	//if(to_ptr->next)	// faster, but assumes always zero-initialized
-	//	return;
+	RECORD(record_uint(RECORD_INIT_TYPED); record_ref(ptr); record_type(type); record_uint(size); record_uint((uintptr_t)ptr->node));
+}
 
-	alloc_node *parent = find_alloc_node(to_ptr);
 
-	if(parent) {
-		if(parent->ptr_list == to_ptr || find_prev_ptr(parent->ptr_list, to_ptr))
-			return;
+void alloc_keep_zeroed(alloc_ptr *ptr) {
+	assert(ptr != NULL && ptr->node != NULL && !ptr->node->type);
 
-		to_ptr->next = parent->ptr_list;
-		parent->ptr_list = to_ptr;
-		return;
-	}
+	RECORD(record_uint(RECORD_KEEP_ZEROED); record_ref(ptr); record_uint((uintptr_t)ptr->node));
+	ptr->node->flags |= NODE_ZEROED;
+}
 
 
-	alloc_frame *frame = current_frame;
+BOOL alloc_is_typed(alloc_ptr *ptr) {
+	assert(ptr != NULL);
+	return ptr->node && ptr->node->type;
+}
 
-	while(frame && frame->ptr_list != to_ptr && !find_prev_ptr(frame->ptr_list, to_ptr))
-		frame = frame->next_frame;
 
-	if(frame)
-		return;
+void alloc_assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr) {
+
+	RECORD(
+		record_uint(RECORD_ASSIGN);
+		record_ref(to_ptr); record_uint((uintptr_t)to_ptr->node); record_uint(to_ptr->next != NULL);
+		record_ref(from_ptr); record_uint(from_ptr ? (uintptr_t)from_ptr->node : 0)
+	);
 
-	to_ptr->next = current_frame->ptr_list;
-	current_frame->ptr_list = to_ptr;
+	assign(to_ptr, from_ptr);
+	track_ptr(to_ptr);
 }
 
 
 void alloc_global_assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr) {
-	
+
+	RECORD(
+		record_uint(RECORD_GLOBAL_ASSIGN);
+		record_ref(to_ptr); record_uint((uintptr_t)to_ptr->node); record_uint(to_ptr->next != NULL);
+		record_ref(from_ptr); record_uint(from_ptr ? (uintptr_t)from_ptr->node : 0)
+	);
+
 	assign(to_ptr, from_ptr);
 
-	if(find_prev_ptr(global_frame.ptr_list, to_ptr))
+	if(global_frame.ptr_list == to_ptr || find_prev_ptr(global_frame.ptr_list, to_ptr))
 		return;
 
 	to_ptr->next = global_frame.ptr_list;
@@ -281,223 +596,1031 @@ void alloc_global_assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr) {
 }
 
 
-void alloc_gc() {
-	alloc_frame *frame = current_frame;
+void alloc_link_root(alloc_root *root) {
+	assert(root != NULL);
+	assert(root->ptr.next == NULL);
 
-	while(frame) {
-		mark_nodes(frame->ptr_list);
-		frame = frame->next_frame;
-	}
+	RECORD(record_uint(RECORD_LINK_ROOT); record_ref(&root->ptr); record_uint((uintptr_t)root->ptr.node));
 
-	gc_nodes(allocations.left);
-	gc_nodes(allocations.right);
+	alloc_root *next = (alloc_root*)roots.ptr.next;
 
-	unmark_nodes(allocations.left);
-	unmark_nodes(allocations.right);
+	root->ptr.next = &next->ptr;
+	root->prev = &roots;
+	next->prev = root;
+	roots.ptr.next = &root->ptr;
 }
 
 
-BOOL alloc_set_max_memory_usage(size_t max_bytes) {
-	BOOL success = TRUE;
+void alloc_assign_root(alloc_root *root, alloc_ptr *from_ptr) {
+	assert(root != NULL);
+	assert(root->ptr.next != NULL);
 
-	if(max_bytes < memory_usage)
-		alloc_gc();
+	RECORD(
+		record_uint(RECORD_ASSIGN_ROOT);
+		record_ref(&root->ptr); record_uint((uintptr_t)root->ptr.node);
+		record_ref(from_ptr); record_uint(from_ptr ? (uintptr_t)from_ptr->node : 0)
+	);
 
-	if(max_bytes < memory_usage) {
-		max_bytes = memory_usage;
-		success = FALSE;
-	}
+	assign(&root->ptr, from_ptr);
+}
 
-	if(max_bytes > max_usage_max) {
-		max_bytes = max_usage_max;
-		success = FALSE;
-	}
 
-	max_usage = max_bytes;
-	return success;
-}
+void alloc_unlink_root(alloc_root *root) {
+	assert(root != NULL);
+	assert(root->ptr.next != NULL);
 
+	RECORD(record_uint(RECORD_UNLINK_ROOT); record_ref(&root->ptr); record_uint((uintptr_t)root->ptr.node));
 
-size_t alloc_max_memory_usage() {
-	return max_usage;
-}
+	alloc_root *next = (alloc_root*)root->ptr.next;
 
+	root->prev->ptr.next = &next->ptr;
+	next->prev = root->prev;
+	decrement_ref_count(&root->ptr);
 
-size_t alloc_memory_usage() {
-	return memory_usage;
+	root->ptr.next = NULL;
+	root->ptr.node = NULL;
+	root->prev = NULL;
 }
 
 
-void assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr) {
-	assert(current_frame != NULL);
-	assert(to_ptr != NULL);
-
-	alloc_node *from_node = NULL;
+void alloc_move_root(alloc_root *to, alloc_root *from) {
+	assert(to != NULL && from != NULL);
+	assert(to->ptr.next == NULL && to->ptr.node == NULL);
+	assert(from->ptr.next != NULL);
 
-	if(from_ptr)
-		from_node = from_ptr->node;
+	RECORD(
+		record_uint(RECORD_MOVE_ROOT);
+		record_ref(&to->ptr); record_ref(&from->ptr); record_uint((uintptr_t)from->ptr.node)
+	);
 
-	if(to_ptr == from_ptr || to_ptr->node == from_node)
-		return;
+	*to = *from;
+	to->prev->ptr.next = &to->ptr;
+	((alloc_root*)to->ptr.next)->prev = to;
 
-	if(from_node)
-		from_node->ref_count++;
+	from->ptr.next = NULL;
+	from->ptr.node = NULL;
+	from->prev = NULL;
+}
 
-	decrement_ref_count(to_ptr);
 
-	to_ptr->node = from_node;
+BOOL alloc_is_shared(alloc_ptr *ptr) {
+	assert(ptr != NULL);
+	return ptr->node && (ptr->node->flags & (NODE_INTERNED | NODE_READ_ONLY));
 }
 
 
-alloc_ptr *remove_ptrs(alloc_ptr *ptr_list, char *data, size_t start_pos, size_t end_pos) {
-	assert(ptr_list != NULL);
-	assert(data != NULL);
-	assert(start_pos < end_pos);
+BOOL alloc_intern(alloc_ptr *ptr, const void *data, size_t size) {
+	assert(current_frame != NULL);
+	assert(ptr != NULL);
 
-	void *start = data + start_pos;
-	void *end = data + end_pos;
-	alloc_ptr *ptr = ptr_list;
-	alloc_ptr *prev_ptr;
-	
-	while(ptr != &end_ptr && (void*)ptr >= start && (void*)ptr < end) {
-		assert(ptr != NULL);
-		decrement_ref_count(ptr);
-		ptr = ptr->next;
+	alloc_node *node = NULL;
+
+	if(size > 0) {
+		uint64_t hash = hashmap_hash(data, size);
+		node = find_interned(data, size, hash);
+
+		if(!node && (node = create_node(size))) {
+			if(add_interned(node, hash)) {
+				memcpy(ALLOC_DATA(node), data, size);
+				node->flags |= NODE_INTERNED;
+				node->ref_count = 0;	// the table's entry is no reference, ptr gets the only one
+			} else {
+				remove_alloc_node(node);
+				free_node(node);
+				node = NULL;
+			}
+		}
 	}
 
-	ptr_list = prev_ptr = ptr;
-
-	while(ptr != &end_ptr) {
-		assert(ptr != NULL);
-
-		while(ptr != &end_ptr && (void*)ptr >= start && (void*)ptr < end)
-			ptr = ptr->next;
-		
-		while(prev_ptr != ptr) {
-			decrement_ref_count(prev_ptr);
-			prev_ptr = prev_ptr->next;
+	RECORD(
+		record_uint(RECORD_INTERN); record_ref(ptr); record_uint((uintptr_t)ptr->node);
+		record_uint(size); if(size > 0) fwrite(data, 1, size, record_file); record_uint((uintptr_t)node)
+	);
 
-			assert(prev_ptr != NULL && prev_ptr != &end_ptr);
-		}
+	alloc_ptr from_ptr = { NULL, node };
+	assign(ptr, &from_ptr);
+	track_ptr(ptr);
+	return node || size == 0;
+}
 
-		prev_ptr = ptr = ptr->next;
-	}
 
-	return ptr_list;
+BOOL alloc_is_interned(alloc_ptr *ptr) {
+	assert(ptr != NULL);
+	return ptr->node && (ptr->node->flags & NODE_INTERNED);
 }
 
 
-alloc_ptr *adjust_next_ptrs(alloc_ptr *ptr_list, ptrdiff_t offset) {
-	assert(ptr_list != NULL);
-	alloc_ptr *next_ptr;
-	alloc_ptr *ptr = ptr_list;
+struct alloc_node* alloc_unshare(alloc_ptr *ptr, size_t offset, size_t size, size_t new_size) {
+	assert(current_frame != NULL);
+	assert(ptr->node != NULL);
+	assert(offset + size <= ptr->node->size);
+	assert(!ptr->node->type);
 
-	if(ptr == &end_ptr)
-		return ptr;
+	alloc_node *new_node = create_node(new_size);
 
-	while(ptr->next != &end_ptr) {
-		assert(ptr != NULL);
+	RECORD(
+		record_uint(RECORD_UNSHARE); record_ref(ptr); record_uint((uintptr_t)ptr->node);
+		record_uint(offset); record_uint(size); record_uint(new_size); record_uint((uintptr_t)new_node)
+	);
 
-		next_ptr = ptr->next;
-		ptr->next = ADJUST_OFFSET(ptr->next, offset);
-		ptr = next_ptr;
-	}
+	if(new_size > 0 && !new_node)
+		return NULL;
 
-	return ADJUST_OFFSET(ptr_list, offset);
+	if(new_node)
+		memcpy(ALLOC_DATA(new_node), (char*)ALLOC_DATA(ptr->node) + offset, size < new_size ? size : new_size);
+
+	decrement_ref_count(ptr);
+	ptr->node = new_node;
+	return new_node;
 }
 
 
-void adjust_node_ptrs(alloc_ptr *ptr_list, alloc_node *old_node, alloc_node *new_node) {
-	alloc_ptr *ptr = ptr_list;
+size_t alloc_growth_x2(size_t size, size_t needed, size_t element_size) {
+	(void)needed;
+	return (size + element_size) * 2;
+}
 
-	while(ptr) {
-		if(ptr->node == old_node)
-			ptr->node = new_node;
-		ptr = ptr->next;
-	}
+
+size_t alloc_growth_x1_5(size_t size, size_t needed, size_t element_size) {
+	(void)needed;
+	return size + size / 2 + element_size;
 }
 
 
-void adjust_node_tree_node_ptrs(alloc_node *parent, alloc_node *old_node, alloc_node *new_node) {
-	if(!parent)
-		return;
+size_t alloc_growth_size_class(size_t size, size_t needed, size_t element_size) {
+	size_t footprint = sizeof(alloc_node) + alloc_growth_x2(size, needed, element_size);
+	size_t rounded = 64;
 
-	adjust_node_ptrs(parent->ptr_list, old_node, new_node);
-	adjust_node_tree_node_ptrs(parent->left, old_node, new_node);
-	adjust_node_tree_node_ptrs(parent->right, old_node, new_node);
+	if(footprint > 4096)
+		rounded = (footprint + 4095) & ~(size_t)4095;
+	else
+		while(rounded < footprint)
+			rounded *= 2;
+
+	return rounded - sizeof(alloc_node);
 }
 
 
-alloc_ptr *find_prev_ptr(alloc_ptr *ptr_list, alloc_ptr *current_ptr) {
-	alloc_ptr *ptr = ptr_list;
+size_t alloc_growth_near_limit(size_t size, size_t needed, size_t element_size) {
+	size_t doubled = alloc_growth_x2(size, needed, element_size);
+	size_t headroom = max_usage > memory_usage ? max_usage - memory_usage : 0;
 
-	while(ptr && ptr->next != current_ptr)
-		ptr = ptr->next;
+	// A node this big is mapped on its own and grows in place with mremap, so
+	// only what it gains has to fit. Any other is copied, and the old node stays
+	// allocated until then.
+	BOOL remapped = size >= alloc_mmap_threshold();
+	size_t kept = remapped ? size : 0;
+	size_t overhead = remapped ? 0 : sizeof(alloc_node);
 
-	return ptr;
-}
+	if(doubled - kept + overhead <= headroom / 2)
+		return doubled;
 
+	size_t conservative = needed + needed / 8;
 
-void decrement_list_ref_count(alloc_ptr *ptr) {
-	while (ptr) {
-		decrement_ref_count(ptr);
-		ptr = ptr->next;
-	}
+	if(conservative - kept + overhead > headroom && needed - kept + overhead <= headroom)
+		conservative = headroom + kept - overhead;
+
+	return conservative;
 }
 
-void decrement_ref_count(alloc_ptr *ptr) {
+
+void alloc_move(alloc_ptr *ptr, size_t to_pos, size_t from_pos, size_t size) {
 	assert(ptr != NULL);
 
-	if(!ptr->node)
+	RECORD(
+		record_uint(RECORD_MOVE); record_ref(ptr); record_uint((uintptr_t)ptr->node);
+		record_uint(to_pos); record_uint(from_pos); record_uint(size)
+	);
+
+	if(size == 0 || to_pos == from_pos)
 		return;
 
 	alloc_node *node = ptr->node;
-	node->ref_count--;
+	assert(node != NULL);
+	assert(to_pos + size <= node->size && from_pos + size <= node->size);
 
-	if (node->ref_count > 0)
-		return;
+	assert(!node->type || (to_pos % node->type->stride == 0 && from_pos % node->type->stride == 0));
 
-	decrement_list_ref_count(node->ptr_list);
+	char *data = ALLOC_DATA(node);
+	char *from_start = data + from_pos;
+	char *from_end = from_start + size;
+	ptrdiff_t offset = (ptrdiff_t)to_pos - (ptrdiff_t)from_pos;
 
-	remove_alloc_node(node);
-	free_node(node);
-}
+	// release the pointers that are about to be overwritten
+	size_t overwrite_start = to_pos < from_pos ? to_pos : (to_pos > from_pos + size ? to_pos : from_pos + size);
+	size_t overwrite_end = to_pos < from_pos ? (to_pos + size < from_pos ? to_pos + size : from_pos) : to_pos + size;
 
+	if(overwrite_start < overwrite_end)
+		release_ptrs(node, overwrite_start, overwrite_end);
 
-alloc_node* malloc_node(size_t size) {
-	assert(memory_usage <= max_usage);
+	memmove(data + to_pos, from_start, size);
 
-	if(size == 0)
-		return NULL;
+	// the moved pointers kept their next links, so only links into the moved range change
+	for(alloc_ptr **link = &node->ptr_list; *link != &end_ptr; link = &(*link)->next) {
+		if((char*)*link >= from_start && (char*)*link < from_end)
+			*link = ADJUST_OFFSET(*link, offset);
+	}
 
-	size_t malloc_amount = sizeof(alloc_node) + size;
+	// the part of the source that was not overwritten holds stale copies
+	size_t stale_start = from_pos;
+	size_t stale_end = from_pos + size;
 
-	if(malloc_amount > max_usage)
-		return NULL;
+	if(to_pos < from_pos)
+		stale_start = to_pos + size > from_pos ? to_pos + size : from_pos;
+	else
+		stale_end = to_pos < from_pos + size ? to_pos : from_pos + size;
 
-	if(malloc_amount + memory_usage > max_usage)
-		alloc_gc();
+	if(node->type)
+		init_typed_ptrs(node, stale_start, stale_end);
+	else
+		memset(data + stale_start, 0, stale_end - stale_start);
+}
 
-	if(malloc_amount + memory_usage > max_usage)
-		return NULL;
 
-	alloc_node *node = malloc(malloc_amount);
+void alloc_clear(alloc_ptr *ptr, size_t pos, size_t size) {
+	assert(ptr != NULL);
 
-	if(!node)
-		return NULL;
+	RECORD(
+		record_uint(RECORD_CLEAR); record_ref(ptr); record_uint((uintptr_t)ptr->node);
+		record_uint(pos); record_uint(size)
+	);
 
-	memory_usage += malloc_amount;
-	return node;
-}
+	if(size == 0 || !ptr->node)
+		return;
 
+	alloc_node *node = ptr->node;
+	assert(pos + size <= node->size);
 
-void free_node(alloc_node *node) {
-	if(node) {
-		assert(memory_usage >= sizeof(alloc_node) + node->size);
-		memory_usage -= sizeof(alloc_node) + node->size;
-	}
+	release_ptrs(node, pos, pos + size);
 
-	free(node);
+	if(node->type)
+		init_typed_ptrs(node, pos, pos + size);
+	else
+		memset((char*)ALLOC_DATA(node) + pos, 0, size);
+}
+
+
+void alloc_detach_ptrs(alloc_ptr *ptr) {
+	assert(ptr != NULL && ptr->node != NULL);
+	assert(!ptr->node->type);
+
+	RECORD(record_uint(RECORD_DETACH_PTRS); record_ref(ptr); record_uint((uintptr_t)ptr->node));
+	ptr->node->ptr_list = &end_ptr;
+}
+
+
+void alloc_attach_ptr(alloc_ptr *ptr, alloc_ptr *contained) {
+	assert(ptr != NULL && ptr->node != NULL && !ptr->node->type);
+	assert((char*)contained >= (char*)ALLOC_DATA(ptr->node));
+	assert((char*)(contained + 1) <= (char*)ALLOC_DATA(ptr->node) + ptr->node->size);
+
+	RECORD(
+		record_uint(RECORD_ATTACH_PTR); record_ref(ptr); record_uint((uintptr_t)ptr->node);
+		record_ref(contained); record_uint((uintptr_t)contained->node)
+	);
+
+	contained->next = ptr->node->ptr_list;
+	ptr->node->ptr_list = contained;
+}
+
+
+BOOL alloc_read_file(alloc_ptr *ptr, const char *filename) {
+	assert(current_frame != NULL);
+
+	alloc_assign(ptr, NULL);
+
+	FILE *file = fopen(filename, "rb");
+
+	if(!file)
+		return FALSE;
+
+	size_t capacity = READ_BLOCK_SIZE;
+
+	if(fseek(file, 0, SEEK_END) == 0) {
+		long end = ftell(file);
+
+		if(end > 0)
+			capacity = (size_t)end;
+
+		rewind(file);
+	}
+
+	alloc_set_node(ptr, alloc_resize(NULL, capacity));
+
+	if(!ptr->node) {
+		fclose(file);
+		return FALSE;
+	}
+
+	size_t size = 0;
+	BOOL success = TRUE;
+
+	// The whole file is read with one fread where its size is known. Growing
+	// is only needed when it turns out bigger, which reading one byte past the
+	// end finds out without a copy.
+	for(;;) {
+		size += fread((char*)ALLOC_DATA(ptr->node) + size, 1, capacity - size, file);
+
+		if(size < capacity)
+			break;
+
+		int ch = fgetc(file);
+
+		if(ch == EOF)
+			break;
+
+		alloc_node *node = alloc_resize(ptr->node, capacity * 2);
+
+		if(!node) {
+			success = FALSE;
+			break;
+		}
+
+		alloc_set_node(ptr, node);
+		capacity *= 2;
+		((char*)ALLOC_DATA(node))[size++] = (char)ch;
+	}
+
+	if(ferror(file))
+		success = FALSE;
+
+	fclose(file);
+
+	if(success && size < capacity) {
+		alloc_node *node = alloc_resize(ptr->node, size);
+
+		if(node || size == 0)
+			alloc_set_node(ptr, node);
+		else
+			success = FALSE;
+	}
+
+	if(!success)
+		alloc_assign(ptr, NULL);
+
+	return success;
+}
+
+
+BOOL alloc_snapshot_save(alloc_ptr *root, size_t size, const char *filename) {
+	assert(root != NULL);
+	assert(size >= sizeof(alloc_ptr));
+
+	size_t count = 0;
+	alloc_node **nodes = collect_nodes(root->node, &count);
+
+	if(root->node && !nodes)
+		return FALSE;
+
+	uint64_t total_size = 0;
+	uint64_t total_ptrs = 0;
+	size_t max_ptrs = 0;
+
+	for(size_t i = 0; i < count; i++) {
+		size_t ptr_count = list_node_ptrs(nodes[i], NULL);
+
+		total_size += nodes[i]->size;
+		total_ptrs += ptr_count;
+
+		if(ptr_count > max_ptrs)
+			max_ptrs = ptr_count;
+	}
+
+	alloc_ptr **ptrs = max_ptrs ? malloc(max_ptrs * sizeof *ptrs) : NULL;
+	FILE *file = max_ptrs && !ptrs ? NULL : fopen(filename, "wb");
+
+	if(!file) {
+		free(ptrs);
+		free(nodes);
+		return FALSE;
+	}
+
+	fwrite(SNAPSHOT_MAGIC, 1, SNAPSHOT_MAGIC_SIZE, file);
+	write_uint(file, count);
+	write_uint(file, total_size);
+	write_uint(file, total_ptrs);
+	write_uint(file, snapshot_index(nodes, count, root->node));
+	write_uint(file, size - sizeof(alloc_ptr));
+	fwrite(root + 1, 1, size - sizeof(alloc_ptr), file);
+
+	for(size_t i = 0; i < count; i++) {
+		alloc_node *node = nodes[i];
+		char *data = ALLOC_DATA(node);
+		size_t ptr_count = list_node_ptrs(node, ptrs);
+
+		write_uint(file, node->size);
+		write_uint(file, (node->flags & (NODE_READ_ONLY | NODE_INTERNED) ? NODE_READ_ONLY : 0) | (node->flags & NODE_ZEROED));
+		write_uint(file, ptr_count);
+
+		for(size_t j = 0; j < ptr_count; j++) {
+			write_uint(file, (uint64_t)((char*)ptrs[j] - data));
+			write_uint(file, snapshot_index(nodes, count, ptrs[j]->node));
+		}
+
+		size_t pos = 0;
+
+		for(size_t j = 0; j < ptr_count; j++) {
+			size_t offset = (size_t)((char*)ptrs[j] - data);
+
+			fwrite(data + pos, 1, offset - pos, file);
+			fwrite(&end_ptr, 1, sizeof(alloc_ptr), file);
+			pos = offset + sizeof(alloc_ptr);
+		}
+
+		fwrite(data + pos, 1, node->size - pos, file);
+	}
+
+	BOOL success = !ferror(file);
+	success = fclose(file) == 0 && success;
+	free(ptrs);
+	free(nodes);
+	return success;
+}
+
+
+// Every node and alloc_ptr is read before any of them is linked up, and room
+// for all of them is made up front, so no gc can run in between and free the
+// nodes read so far.
+BOOL alloc_snapshot_load(alloc_ptr *ptr, size_t size, const char *filename) {
+	assert(current_frame != NULL);
+	assert(size >= sizeof(alloc_ptr));
+
+	alloc_assign(ptr, NULL);
+	memset(ptr + 1, 0, size - sizeof(alloc_ptr));
+
+#ifdef ALLOC_RECORD
+	// a replay has no way to make the nodes a snapshot holds
+	if(record_file)
+		return FALSE;
+#endif
+
+	FILE *file = fopen(filename, "rb");
+
+	if(!file)
+		return FALSE;
+
+	char magic[SNAPSHOT_MAGIC_SIZE];
+	uint64_t count, total_size, total_ptrs, root, root_size;
+
+	BOOL success = fread(magic, 1, SNAPSHOT_MAGIC_SIZE, file) == SNAPSHOT_MAGIC_SIZE
+		&& memcmp(magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) == 0
+		&& read_uint(file, &count) && read_uint(file, &total_size) && read_uint(file, &total_ptrs)
+		&& read_uint(file, &root) && read_uint(file, &root_size)
+		&& root <= count && root_size == size - sizeof(alloc_ptr)
+		&& count <= SIZE_MAX / sizeof(alloc_node*) && total_ptrs <= SIZE_MAX / sizeof(alloc_ptr*)
+		&& total_size <= max_usage && count <= (max_usage - total_size) / sizeof(alloc_node)
+		&& fread(ptr + 1, 1, size - sizeof(alloc_ptr), file) == size - sizeof(alloc_ptr);
+
+	if(success && total_size + count * sizeof(alloc_node) > max_usage - memory_usage)
+		gc();
+
+	if(success && total_size + count * sizeof(alloc_node) > max_usage - memory_usage)
+		success = FALSE;
+
+	alloc_node **nodes = success ? malloc((count ? count : 1) * sizeof *nodes) : NULL;
+	alloc_ptr **ptrs = nodes ? malloc((total_ptrs ? total_ptrs : 1) * sizeof *ptrs) : NULL;
+	size_t *targets = ptrs ? malloc((total_ptrs ? total_ptrs : 1) * sizeof *targets) : NULL;
+	size_t loaded = 0;
+	size_t ptr_total = 0;
+
+	success = success && targets;
+
+	while(success && loaded < count) {
+		uint64_t node_size, flags, ptr_count;
+
+		success = read_uint(file, &node_size) && read_uint(file, &flags) && read_uint(file, &ptr_count)
+			&& node_size > 0 && node_size <= total_size && ptr_count <= total_ptrs - ptr_total;
+
+		alloc_node *node = success ? malloc_node((size_t)node_size) : NULL;
+
+		if(!node) {
+			success = FALSE;
+			break;
+		}
+
+		nodes[loaded++] = node;
+		node->ptr_list = &end_ptr;
+		node->type = NULL;
+		node->ref_count = 0;
+		node->flags |= (uint32_t)flags & (NODE_READ_ONLY | NODE_ZEROED);
+		node->size = (size_t)node_size;
+		TRACE(TRACE_NEW, node, node->size);
+
+		// aligned and in increasing order without overlapping, so each one is a distinct alloc_ptr
+		for(uint64_t i = 0, next_offset = 0; success && i < ptr_count; i++) {
+			uint64_t offset, target;
+
+			success = read_uint(file, &offset) && read_uint(file, &target) && offset >= next_offset
+				&& offset % sizeof(void*) == 0 && node_size >= sizeof(alloc_ptr) && offset <= node_size - sizeof(alloc_ptr)
+				&& target <= count;
+
+			if(success) {
+				ptrs[ptr_total] = (alloc_ptr*)((char*)ALLOC_DATA(node) + offset);
+				targets[ptr_total++] = (size_t)target;
+				next_offset = offset + sizeof(alloc_ptr);
+			}
+		}
+
+		success = success && fread(ALLOC_DATA(node), 1, node->size, file) == node->size;
+
+		// links each alloc_ptr into the list of the node it is in
+		for(size_t i = ptr_total - (size_t)ptr_count; success && i < ptr_total; i++) {
+			ptrs[i]->next = node->ptr_list;
+			node->ptr_list = ptrs[i];
+		}
+	}
+
+	fclose(file);
+
+	if(success) {
+		for(size_t i = 0; i < ptr_total; i++) {
+			ptrs[i]->node = targets[i] ? nodes[targets[i] - 1] : NULL;
+
+			if(ptrs[i]->node)
+				ptrs[i]->node->ref_count++;
+		}
+
+		add_alloc_nodes(nodes, count);
+
+		if(root) {
+			ptr->node = nodes[root - 1];
+			ptr->node->ref_count++;
+		}
+	} else {
+		for(size_t i = 0; i < loaded; i++)
+			free_node(nodes[i]);
+
+		memset(ptr + 1, 0, size - sizeof(alloc_ptr));
+	}
+
+	free(targets);
+	free(ptrs);
+	free(nodes);
+	return success;
+}
+
+
+void alloc_gc() {
+	RECORD(record_uint(RECORD_GC));
+	gc();
+}
+
+
+void gc() {
+	TRACE(TRACE_GC_BEGIN, NULL, memory_usage);
+	gc_count++;
+
+	alloc_frame *frame = current_frame;
+
+	while(frame) {
+		mark_nodes(frame->ptr_list);
+		frame = frame->next_frame;
+	}
+
+	mark_nodes(roots.ptr.next);
+	gc_nodes(allocations.left);
+	gc_nodes(allocations.right);
+
+	unmark_nodes(allocations.left);
+	unmark_nodes(allocations.right);
+
+	TRACE(TRACE_GC_END, NULL, memory_usage);
+}
+
+
+BOOL alloc_set_max_memory_usage(size_t max_bytes) {
+	BOOL success = TRUE;
+
+	RECORD(record_uint(RECORD_SET_MAX_MEMORY); record_uint(max_bytes));
+
+	if(max_bytes < memory_usage)
+		gc();
+
+	if(max_bytes < memory_usage) {
+		max_bytes = memory_usage;
+		success = FALSE;
+	}
+
+	if(max_bytes > max_usage_max) {
+		max_bytes = max_usage_max;
+		success = FALSE;
+	}
+
+	max_usage = max_bytes;
+	return success;
+}
+
+
+BOOL alloc_set_mmap_threshold(size_t min_bytes) {
+	RECORD(record_uint(RECORD_SET_MMAP_THRESHOLD); record_uint(min_bytes));
+
+#ifdef ALLOC_MMAP
+	mmap_threshold = min_bytes;
+	return TRUE;
+#else
+	(void)min_bytes;
+	return FALSE;
+#endif
+}
+
+
+size_t alloc_mmap_threshold() {
+#ifdef ALLOC_MMAP
+	return mmap_threshold;
+#else
+	return SIZE_MAX;
+#endif
+}
+
+
+size_t alloc_max_memory_usage() {
+	return max_usage;
+}
+
+
+size_t alloc_memory_usage() {
+	return memory_usage;
+}
+
+
+size_t alloc_peak_memory_usage() {
+	return peak_memory_usage;
+}
+
+
+void alloc_reset_peak_memory_usage() {
+	peak_memory_usage = memory_usage;
+}
+
+
+size_t alloc_allocation_count() {
+	return allocation_count;
+}
+
+
+size_t alloc_gc_count() {
+	return gc_count;
+}
+
+
+void assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr) {
+	assert(current_frame != NULL);
+	assert(to_ptr != NULL);
+
+	alloc_node *from_node = NULL;
+
+	if(from_ptr)
+		from_node = from_ptr->node;
+
+	if(to_ptr == from_ptr || to_ptr->node == from_node)
+		return;
+
+	if(from_node)
+		from_node->ref_count++;
+
+	decrement_ref_count(to_ptr);
+
+	to_ptr->node = from_node;
+}
+
+
+// Links an alloc_ptr that was just assigned into the list of the node or frame
+// it is in, unless it is there already. Only where untracked pointers are known
+// to be zeroed does a next mean that it is: in typed nodes, whose alloc_ptrs
+// get end_ptr as their next up front, and in nodes marked by alloc_keep_zeroed.
+// Anywhere else a next may be left over from memory that alloc_resize grew or
+// that was copied in, so the list is searched.
+void track_ptr(alloc_ptr *ptr) {
+	alloc_node *parent = find_alloc_node(ptr);
+
+	if(parent && parent->type) {
+		ptr->next = &end_ptr;
+		return;
+	}
+
+	if(parent && (parent->flags & NODE_ZEROED)) {
+		if(!ptr->next) {
+			ptr->next = parent->ptr_list;
+			parent->ptr_list = ptr;
+		}
+		return;
+	}
+
+	if(parent) {
+		if(parent->ptr_list == ptr || find_prev_ptr(parent->ptr_list, ptr))
+			return;
+
+		ptr->next = parent->ptr_list;
+		parent->ptr_list = ptr;
+		return;
+	}
+
+
+	alloc_frame *frame = current_frame;
+
+	while(frame && frame->ptr_list != ptr && !find_prev_ptr(frame->ptr_list, ptr))
+		frame = frame->next_frame;
+
+	if(frame)
+		return;
+
+	ptr->next = current_frame->ptr_list;
+	current_frame->ptr_list = ptr;
+}
+
+
+// releases the alloc_ptrs stored in node's data between start_pos and end_pos
+void release_ptrs(alloc_node *node, size_t start_pos, size_t end_pos) {
+	alloc_ptr *ptr;
+
+	if(!node->type) {
+		node->ptr_list = remove_ptrs(node->ptr_list, ALLOC_DATA(node), start_pos, end_pos);
+		return;
+	}
+
+	FOR_EACH_TYPED_PTR(ptr, node, node->size, start_pos, end_pos)
+		decrement_ref_count(ptr);
+}
+
+
+// whether release_ptrs would release anything in this part of a node's data
+BOOL holds_ptrs(alloc_node *node, size_t start_pos, size_t end_pos) {
+	alloc_ptr *ptr;
+
+	if(!node->type) {
+		for(ptr = node->ptr_list; ptr != &end_ptr; ptr = ptr->next) {
+			if((char*)ptr >= (char*)ALLOC_DATA(node) + start_pos && (char*)ptr < (char*)ALLOC_DATA(node) + end_pos)
+				return TRUE;
+		}
+
+		return FALSE;
+	}
+
+	FOR_EACH_TYPED_PTR(ptr, node, node->size, start_pos, end_pos) {
+		if(ptr->node)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+// zeroes part of a typed node's data, with end_ptr as the next of the alloc_ptrs there
+void init_typed_ptrs(alloc_node *node, size_t start_pos, size_t end_pos) {
+	alloc_ptr *ptr;
+
+	memset((char*)ALLOC_DATA(node) + start_pos, 0, end_pos - start_pos);
+
+	FOR_EACH_TYPED_PTR(ptr, node, node->size, start_pos, end_pos)
+		ptr->next = &end_ptr;
+}
+
+
+alloc_ptr *remove_ptrs(alloc_ptr *ptr_list, char *data, size_t start_pos, size_t end_pos) {
+	assert(ptr_list != NULL);
+	assert(data != NULL);
+	assert(start_pos < end_pos);
+
+	void *start = data + start_pos;
+	void *end = data + end_pos;
+	alloc_ptr **link = &ptr_list;
+
+	while(*link != &end_ptr) {
+		alloc_ptr *ptr = *link;
+		assert(ptr != NULL);
+
+		if((void*)ptr >= start && (void*)ptr < end) {
+			*link = ptr->next;
+			decrement_ref_count(ptr);
+		} else {
+			link = &ptr->next;
+		}
+	}
+
+	return ptr_list;
+}
+
+
+alloc_ptr *adjust_next_ptrs(alloc_ptr *ptr_list, ptrdiff_t offset) {
+	assert(ptr_list != NULL);
+	alloc_ptr *next_ptr;
+	alloc_ptr *ptr = ptr_list;
+
+	if(ptr == &end_ptr)
+		return ptr;
+
+	while(ptr->next != &end_ptr) {
+		assert(ptr != NULL);
+
+		next_ptr = ptr->next;
+		ptr->next = ADJUST_OFFSET(ptr->next, offset);
+		ptr = next_ptr;
+	}
+
+	return ADJUST_OFFSET(ptr_list, offset);
+}
+
+
+void adjust_node_ptrs(alloc_ptr *ptr_list, alloc_node *old_node, alloc_node *new_node) {
+	alloc_ptr *ptr = ptr_list;
+
+	while(ptr) {
+		if(ptr->node == old_node)
+			ptr->node = new_node;
+		ptr = ptr->next;
+	}
+}
+
+
+void adjust_node_tree_node_ptrs(alloc_node *parent, alloc_node *old_node, alloc_node *new_node) {
+	alloc_ptr *ptr;
+
+	if(!parent)
+		return;
+
+	if(parent->type) {
+		FOR_EACH_TYPED_PTR(ptr, parent, parent->size, 0, parent->size) {
+			if(ptr->node == old_node)
+				ptr->node = new_node;
+		}
+	} else {
+		adjust_node_ptrs(parent->ptr_list, old_node, new_node);
+	}
+
+	adjust_node_tree_node_ptrs(parent->left, old_node, new_node);
+	adjust_node_tree_node_ptrs(parent->right, old_node, new_node);
+}
+
+
+alloc_ptr *find_prev_ptr(alloc_ptr *ptr_list, alloc_ptr *current_ptr) {
+	alloc_ptr *ptr = ptr_list;
+
+	while(ptr && ptr->next != current_ptr)
+		ptr = ptr->next;
+
+	return ptr;
+}
+
+
+void decrement_list_ref_count(alloc_ptr *ptr) {
+	while (ptr) {
+		decrement_ref_count(ptr);
+		ptr = ptr->next;
+	}
+}
+
+// Unlinks each pointer as well, since alloc_assign takes a pointer with a next
+// to be tracked already, and clears its node, which may be freed here. Static
+// pointers assigned inside a frame outlive it.
+void release_frame_ptrs(alloc_ptr *ptr) {
+	while(ptr) {
+		alloc_ptr *next = ptr->next;
+		decrement_ref_count(ptr);
+		ptr->next = NULL;
+		ptr->node = NULL;
+		ptr = next;
+	}
+}
+
+void decrement_ref_count(alloc_ptr *ptr) {
+	assert(ptr != NULL);
+
+	if(!ptr->node)
+		return;
+
+	alloc_node *node = ptr->node;
+	node->ref_count--;
+
+	if (node->ref_count > 0)
+		return;
+
+	if(node->type)
+		release_ptrs(node, 0, node->size);
+	else
+		decrement_list_ref_count(node->ptr_list);
+
+	remove_alloc_node(node);
+	free_node(node);
+}
+
+
+alloc_node* malloc_node(size_t size) {
+	assert(memory_usage <= max_usage);
+
+	if(size == 0)
+		return NULL;
+
+	size_t malloc_amount = sizeof(alloc_node) + size;
+
+	if(malloc_amount > max_usage)
+		return NULL;
+
+	if(malloc_amount + memory_usage > max_usage)
+		gc();
+
+	if(malloc_amount + memory_usage > max_usage)
+		return NULL;
+
+	alloc_node *node;
+
+#ifdef ALLOC_MMAP
+	if(size >= mmap_threshold) {
+		node = mmap(NULL, malloc_amount, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if(node == MAP_FAILED)
+			return NULL;
+
+		node->flags = NODE_MAPPED;
+	} else
+#endif
+	{
+		node = malloc(malloc_amount);
+
+		if(!node)
+			return NULL;
+
+		node->flags = 0;
+	}
+
+	memory_usage += malloc_amount;
+	allocation_count++;
+
+	if(memory_usage > peak_memory_usage)
+		peak_memory_usage = memory_usage;
+
+	return node;
+}
+
+
+#ifdef ALLOC_MMAP
+// Resizes a node from malloc_node's mmap with mremap, which moves its pages
+// rather than copying them. The old node is gone once this returns, so it is
+// taken out of the tree first, and put back if mremap fails. Its pointer list
+// is then adjusted where it ended up. It never drops alloc_ptrs: alloc_resize
+// only remaps a shrink that holds none past the new size. The caller updates
+// the pointers to the node.
+alloc_node* remap_node(alloc_node *node, size_t new_size) {
+	size_t old_size = node->size;
+
+	if(new_size > old_size) {
+		size_t growth = new_size - old_size;
+
+		if(growth > max_usage - memory_usage)
+			gc();
+
+		if(growth > max_usage - memory_usage)
+			return NULL;
+	}
+
+	assert(new_size >= old_size || !holds_ptrs(node, new_size, old_size));
+
+	remove_alloc_node(node);
+
+	alloc_node *new_node = mremap(node, sizeof(alloc_node) + old_size, sizeof(alloc_node) + new_size, MREMAP_MAYMOVE);
+
+	if(new_node == MAP_FAILED) {
+		add_alloc_node(&allocations, node);
+		return NULL;
+	}
+
+	ptrdiff_t offset = (char*)new_node - (char*)node;
+
+	for(alloc_ptr **link = &new_node->ptr_list; *link != &end_ptr; link = &(*link)->next)
+		*link = ADJUST_OFFSET(*link, offset);
+
+	memory_usage = memory_usage - old_size + new_size;
+	allocation_count++;
+
+	if(memory_usage > peak_memory_usage)
+		peak_memory_usage = memory_usage;
+
+	new_node->size = new_size;
+	new_node->left = NULL;
+	new_node->right = NULL;
+	return new_node;
+}
+#endif
+
+
+void free_node(alloc_node *node) {
+	if(!node)
+		return;
+
+	assert(memory_usage >= sizeof(alloc_node) + node->size);
+	memory_usage -= sizeof(alloc_node) + node->size;
+
+	if(node->flags & NODE_INTERNED)
+		remove_interned(node);
+	TRACE(TRACE_FREE, node, node->size);
+
+#ifdef ALLOC_MMAP
+	if(node->flags & NODE_MAPPED) {
+		munmap(node, sizeof(alloc_node) + node->size);
+		return;
+	}
+#endif
+
+	free(node);
 }
 
 
@@ -505,16 +1628,30 @@ void mark_nodes(alloc_ptr *ptr_list) {
 	alloc_ptr *ptr = ptr_list;
 
 	while(ptr) {
-		if(ptr->node && ptr->node->size < max_usage_max) {
-			ptr->node->size += max_usage_max;
-			mark_nodes(ptr->node->ptr_list);
-		}
-
+		mark_node(ptr->node);
 		ptr = ptr->next;
 	}
 }
 
 
+void mark_node(alloc_node *node) {
+	alloc_ptr *ptr;
+
+	if(!node || node->size >= max_usage_max)
+		return;
+
+	size_t size = node->size;
+	node->size += max_usage_max;
+
+	if(node->type) {
+		FOR_EACH_TYPED_PTR(ptr, node, size, 0, size)
+			mark_node(ptr->node);
+	} else {
+		mark_nodes(node->ptr_list);
+	}
+}
+
+
 void gc_nodes(alloc_node *parent) {
 	if(!parent)
 		return;
@@ -523,7 +1660,6 @@ void gc_nodes(alloc_node *parent) {
 	gc_nodes(parent->right);
 
 	if(parent->size < max_usage_max) {
-		parent->size -= max_usage_max;
 		remove_alloc_node(parent);	// will break if the nodes become a balanced tree
 		free_node(parent);
 	}
@@ -543,6 +1679,30 @@ void unmark_nodes(alloc_node *parent) {
 }
 
 
+// the memory in the nodes reachable from linked roots
+size_t root_usage() {
+	mark_nodes(roots.ptr.next);
+	return unmark_held_nodes(allocations.left) + unmark_held_nodes(allocations.right);
+}
+
+
+// unmark_nodes for a tree where only some nodes are marked, giving the memory
+// in those
+size_t unmark_held_nodes(alloc_node *parent) {
+	if(!parent)
+		return 0;
+
+	size_t held = unmark_held_nodes(parent->left) + unmark_held_nodes(parent->right);
+
+	if(parent->size >= max_usage_max) {
+		parent->size -= max_usage_max;
+		held += sizeof(alloc_node) + parent->size;
+	}
+
+	return held;
+}
+
+
 void add_alloc_node(alloc_node *parent, alloc_node *node) {
 	assert(parent != NULL);
 	assert(node != NULL);
@@ -572,6 +1732,53 @@ void add_alloc_node(alloc_node *parent, alloc_node *node) {
 }
 
 
+// Adds nodes to the tree and rebalances all of it, by listing the nodes
+// already there in order, merging the new ones in and building both sides of
+// the root again. Falls back to adding them one at a time without the memory
+// for that.
+void add_alloc_nodes(alloc_node **nodes, size_t count) {
+	size_t existing = list_alloc_nodes(allocations.left, NULL) + list_alloc_nodes(allocations.right, NULL);
+	alloc_node **sorted = malloc((existing + count + 1) * sizeof *sorted);
+	alloc_node **merged = sorted ? malloc((existing + count + 1) * sizeof *merged) : NULL;
+
+	if(!merged) {
+		for(size_t i = 0; i < count; i++)
+			add_alloc_node(&allocations, nodes[i]);
+
+		free(sorted);
+		return;
+	}
+
+	memcpy(sorted, nodes, count * sizeof *nodes);
+	qsort(sorted, count, sizeof *sorted, compare_addresses);
+
+	size_t left = list_alloc_nodes(allocations.left, merged + count);
+	list_alloc_nodes(allocations.right, merged + count + left);
+
+	// the new nodes move in front of the existing ones as they are merged
+	alloc_node **old_nodes = merged + count;
+	size_t i = 0, j = 0, k = 0;
+
+	while(i < count || j < existing) {
+		if(j == existing || (i < count && (uintptr_t)sorted[i] < (uintptr_t)old_nodes[j]))
+			merged[k++] = sorted[i++];
+		else
+			merged[k++] = old_nodes[j++];
+	}
+
+	size_t split = 0;
+
+	while(split < k && (uintptr_t)merged[split] < (uintptr_t)&allocations)
+		split++;
+
+	allocations.left = build_alloc_tree(merged, split, &allocations);
+	allocations.right = build_alloc_tree(merged + split, k - split, &allocations);
+
+	free(merged);
+	free(sorted);
+}
+
+
 void remove_alloc_node(alloc_node *node) {
 	assert(node != NULL);
 	assert(node->parent != NULL);
@@ -598,6 +1805,59 @@ void remove_alloc_node(alloc_node *node) {
 }
 
 
+// The nodes under root in address order, into nodes unless that is NULL.
+// Walks the parent links, so that a degenerate tree cannot overflow the stack.
+size_t list_alloc_nodes(alloc_node *root, alloc_node **nodes) {
+	size_t count = 0;
+	alloc_node *node = root;
+
+	if(!node)
+		return 0;
+
+	while(node->left)
+		node = node->left;
+
+	for(;;) {
+		if(nodes)
+			nodes[count] = node;
+
+		count++;
+
+		if(node->right) {
+			node = node->right;
+
+			while(node->left)
+				node = node->left;
+		} else {
+			while(node != root && node == node->parent->right)
+				node = node->parent;
+
+			if(node == root)
+				break;
+
+			node = node->parent;
+		}
+	}
+
+	return count;
+}
+
+
+// a balanced tree of nodes, which are in address order
+alloc_node* build_alloc_tree(alloc_node **nodes, size_t count, alloc_node *parent) {
+	if(count == 0)
+		return NULL;
+
+	size_t middle = count / 2;
+	alloc_node *node = nodes[middle];
+
+	node->parent = parent;
+	node->left = build_alloc_tree(nodes, middle, node);
+	node->right = build_alloc_tree(nodes + middle + 1, count - middle - 1, node);
+	return node;
+}
+
+
 alloc_node* find_alloc_node(alloc_ptr *contains) {
 	assert(contains != NULL);
 
@@ -624,6 +1884,416 @@ alloc_node* find_alloc_node(alloc_ptr *contains) {
 }
 
 
+alloc_node* find_interned(const void *data, size_t size, uint64_t hash) {
+	if(!intern_entries)
+		return NULL;
+
+	size_t mask = intern_capacity - 1;
+
+	for(size_t pos = hash & mask; intern_entries[pos].node; pos = (pos + 1) & mask) {
+		alloc_node *node = intern_entries[pos].node;
+
+		if(intern_entries[pos].hash == hash && node->size == size && memcmp(ALLOC_DATA(node), data, size) == 0)
+			return node;
+	}
+
+	return NULL;
+}
+
+
+// grows the table by doubling while more than three quarters would be used
+BOOL add_interned(alloc_node *node, uint64_t hash) {
+	if((intern_count + 1) * 4 > intern_capacity * 3) {
+		size_t capacity = intern_capacity ? intern_capacity * 2 : INTERN_MIN_CAPACITY;
+		intern_entry *entries = calloc(capacity, sizeof(intern_entry));
+
+		if(!entries)
+			return FALSE;
+
+		for(size_t i = 0; i < intern_capacity; i++) {
+			if(!intern_entries[i].node)
+				continue;
+
+			size_t pos = intern_entries[i].hash & (capacity - 1);
+
+			while(entries[pos].node)
+				pos = (pos + 1) & (capacity - 1);
+
+			entries[pos] = intern_entries[i];
+		}
+
+		free(intern_entries);
+		intern_entries = entries;
+		intern_capacity = capacity;
+	}
+
+	size_t mask = intern_capacity - 1;
+	size_t pos = hash & mask;
+
+	while(intern_entries[pos].node)
+		pos = (pos + 1) & mask;
+
+	intern_entries[pos].node = node;
+	intern_entries[pos].hash = hash;
+	intern_count++;
+	return TRUE;
+}
+
+
+// Called from free_node while node's data is still there to hash. The entries
+// after it that could have been placed where it was move back into its place,
+// so that no lookup stops short of them.
+void remove_interned(alloc_node *node) {
+	size_t mask = intern_capacity - 1;
+	size_t pos = hashmap_hash(ALLOC_DATA(node), node->size) & mask;
+
+	while(intern_entries[pos].node != node)
+		pos = (pos + 1) & mask;
+
+	for(size_t next = (pos + 1) & mask; intern_entries[next].node; next = (next + 1) & mask) {
+		size_t home = intern_entries[next].hash & mask;
+
+		if(((next - home) & mask) >= ((next - pos) & mask)) {
+			intern_entries[pos] = intern_entries[next];
+			pos = next;
+		}
+	}
+
+	intern_entries[pos].node = NULL;
+
+	if(--intern_count == 0) {
+		free(intern_entries);
+		intern_entries = NULL;
+		intern_capacity = 0;
+	}
+}
+
+
+// Every node reachable from root, in address order, or NULL if there are none
+// or there is no memory for them. The array doubles as the queue of nodes
+// whose alloc_ptrs are still to be followed.
+alloc_node** collect_nodes(alloc_node *root, size_t *count) {
+	size_t capacity = 64;
+	alloc_node **nodes = root ? malloc(capacity * sizeof *nodes) : NULL;
+	BOOL success = nodes != NULL;
+
+	*count = 0;
+
+	if(!nodes)
+		return NULL;
+
+	root->flags |= NODE_SNAPSHOT;
+	nodes[(*count)++] = root;
+
+	for(size_t i = 0; success && i < *count; i++) {
+		alloc_node *node = nodes[i];
+		alloc_ptr *ptr;
+
+		if(node->type) {
+			FOR_EACH_TYPED_PTR(ptr, node, node->size, 0, node->size)
+				success = success && collect_node(&nodes, count, &capacity, ptr->node);
+		} else {
+			for(ptr = node->ptr_list; success && ptr != &end_ptr; ptr = ptr->next)
+				success = collect_node(&nodes, count, &capacity, ptr->node);
+		}
+	}
+
+	for(size_t i = 0; i < *count; i++)
+		nodes[i]->flags &= ~NODE_SNAPSHOT;
+
+	if(!success) {
+		free(nodes);
+		*count = 0;
+		return NULL;
+	}
+
+	qsort(nodes, *count, sizeof *nodes, compare_addresses);
+	return nodes;
+}
+
+
+// adds node to the nodes collected so far, unless it is NULL or already there
+BOOL collect_node(alloc_node ***nodes, size_t *count, size_t *capacity, alloc_node *node) {
+	if(!node || (node->flags & NODE_SNAPSHOT))
+		return TRUE;
+
+	if(*count == *capacity) {
+		alloc_node **grown = realloc(*nodes, *capacity * 2 * sizeof **nodes);
+
+		if(!grown)
+			return FALSE;
+
+		*nodes = grown;
+		*capacity *= 2;
+	}
+
+	node->flags |= NODE_SNAPSHOT;
+	(*nodes)[(*count)++] = node;
+	return TRUE;
+}
+
+
+// The alloc_ptrs in node's data in address order, into ptrs unless that is
+// NULL. For a typed node that is every one in its layout, NULL or not.
+size_t list_node_ptrs(alloc_node *node, alloc_ptr **ptrs) {
+	size_t count = 0;
+	alloc_ptr *ptr;
+
+	if(node->type) {
+		FOR_EACH_TYPED_PTR(ptr, node, node->size, 0, node->size) {
+			if(ptrs)
+				ptrs[count] = ptr;
+
+			count++;
+		}
+
+		return count;
+	}
+
+	for(ptr = node->ptr_list; ptr != &end_ptr; ptr = ptr->next) {
+		if(ptrs)
+			ptrs[count] = ptr;
+
+		count++;
+	}
+
+	if(ptrs && count > 1)
+		qsort(ptrs, count, sizeof *ptrs, compare_addresses);
+
+	return count;
+}
+
+
+// node's number in a snapshot of nodes, 0 for NULL
+uint64_t snapshot_index(alloc_node **nodes, size_t count, alloc_node *node) {
+	if(!node)
+		return 0;
+
+	alloc_node **found = bsearch(&node, nodes, count, sizeof *nodes, compare_addresses);
+	assert(found != NULL);
+	return (uint64_t)(found - nodes) + 1;
+}
+
+
+// orders an array of pointers by address
+int compare_addresses(const void *a, const void *b) {
+	uintptr_t first = (uintptr_t)*(void* const*)a;
+	uintptr_t second = (uintptr_t)*(void* const*)b;
+
+	return first < second ? -1 : first > second;
+}
+
+
+void write_uint(FILE *file, uint64_t value) {
+	while(value >= 0x80) {
+		putc((int)(value & 0x7f) | 0x80, file);
+		value >>= 7;
+	}
+
+	putc((int)value, file);
+}
+
+
+BOOL read_uint(FILE *file, uint64_t *value) {
+	*value = 0;
+
+	for(unsigned shift = 0; shift < 64; shift += 7) {
+		int byte = getc(file);
+
+		if(byte == EOF)
+			return FALSE;
+
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+
+		if(!(byte & 0x80))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+#ifdef ALLOC_RECORD
+
+BOOL alloc_record_start(const char *filename) {
+	alloc_record_stop();
+
+	record_file = fopen(filename, "wb");
+
+	if(!record_file)
+		return FALSE;
+
+	fwrite(ALLOC_RECORD_MAGIC, 1, ALLOC_RECORD_MAGIC_SIZE, record_file);
+	return TRUE;
+}
+
+
+BOOL alloc_record_stop() {
+	if(!record_file)
+		return FALSE;
+
+	BOOL success = !ferror(record_file);
+	success = fclose(record_file) == 0 && success;
+	record_file = NULL;
+	return success;
+}
+
+
+void record_uint(uint64_t value) {
+	write_uint(record_file, value);
+}
+
+
+void record_type(const alloc_type *type) {
+	record_uint(type->stride);
+	record_uint(type->ptr_count);
+
+	for(size_t i = 0; i < type->ptr_count; i++)
+		record_uint(type->ptr_offsets[i]);
+}
+
+
+void record_ref(alloc_ptr *ptr) {
+	if(!ptr) {
+		record_uint(RECORD_REF_NULL);
+		return;
+	}
+
+	alloc_node *node = find_alloc_node(ptr);
+
+	if(node && node != &allocations) {
+		record_uint(RECORD_REF_NODE);
+		record_uint((uintptr_t)node);
+		record_uint((uintptr_t)((char*)ptr - (char*)ALLOC_DATA(node)));
+		return;
+	}
+
+	alloc_frame *frame = current_frame;
+	size_t depth = 0;
+
+	while(frame && ptr != &frame->return_value.ptr) {
+		frame = frame->next_frame;
+		depth++;
+	}
+
+	if(frame) {
+		record_uint(RECORD_REF_RETURN);
+		record_uint(depth);
+	} else {
+		record_uint(RECORD_REF_OTHER);
+		record_uint((uintptr_t)ptr);
+	}
+}
+
+#else
+
+BOOL alloc_record_start(const char *filename) {
+	(void)filename;
+	return FALSE;
+}
+
+
+BOOL alloc_record_stop() {
+	return FALSE;
+}
+
+#endif
+
+
+#ifdef ALLOC_TRACE
+
+void trace(trace_type type, const void *ptr, size_t value) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	trace_event *event = &trace_events[trace_count++ & (ALLOC_TRACE_CAPACITY - 1)];
+	event->timestamp = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+	event->ptr = ptr;
+	event->value = value;
+	event->memory_usage = memory_usage;
+	event->type = (unsigned char)type;
+}
+
+
+BOOL alloc_trace_dump(const char *filename) {
+	FILE *file = fopen(filename, "w");
+
+	if(!file)
+		return FALSE;
+
+	size_t count = trace_count < ALLOC_TRACE_CAPACITY ? trace_count : ALLOC_TRACE_CAPACITY;
+	size_t first = trace_count - count;
+	const char *separator = "";
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+
+	for(size_t i = first; i < trace_count; i++) {
+		trace_event *event = &trace_events[i & (ALLOC_TRACE_CAPACITY - 1)];
+		double ts = event->timestamp / 1000.0;	// trace_event timestamps are in microseconds
+
+		switch(event->type) {
+		case TRACE_BEGIN:
+		case TRACE_END:
+			fprintf(file, "%s\n{\"name\":\"", separator);
+			write_json_string(file, (const char*)event->ptr);
+			fprintf(file, ":%d\",\"cat\":\"frame\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+				(int)event->value, event->type == TRACE_BEGIN ? "B" : "E", ts);
+			break;
+		case TRACE_GC_BEGIN:
+		case TRACE_GC_END:
+			fprintf(file, "%s\n{\"name\":\"alloc_gc\",\"cat\":\"gc\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+				separator, event->type == TRACE_GC_BEGIN ? "B" : "E", ts);
+			break;
+		default:
+			fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"alloc\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":1,"
+				"\"args\":{\"node\":\"%p\",\"size\":%lu}}",
+				separator, event->type == TRACE_NEW ? "alloc_new" : event->type == TRACE_RESIZE ? "alloc_resize" : "free_node",
+				ts, event->ptr, (unsigned long)event->value);
+			break;
+		}
+
+		fprintf(file, ",\n{\"name\":\"memory_usage\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"bytes\":%lu}}",
+			ts, (unsigned long)event->memory_usage);
+		separator = ",";
+	}
+
+	fputs("\n]}\n", file);
+	return fclose(file) == 0;
+}
+
+
+void alloc_trace_clear() {
+	trace_count = 0;
+}
+
+
+// the contents of a JSON string, as __FILE__ can hold backslashes, quotes or
+// anything else a file name can
+void write_json_string(FILE *file, const char *string) {
+	for(const unsigned char *c = (const unsigned char*)string; *c; c++) {
+		if(*c == '"' || *c == '\\')
+			fprintf(file, "\\%c", *c);
+		else if(*c < 0x20)
+			fprintf(file, "\\u%04x", *c);
+		else
+			fputc(*c, file);
+	}
+}
+
+#else
+
+BOOL alloc_trace_dump(const char *filename) {
+	(void)filename;
+	return FALSE;
+}
+
+
+void alloc_trace_clear() {
+}
+
+#endif
+
+
 void alloc_debug_info() {
 	alloc_frame *frame = current_frame;
 
@@ -3,6 +3,10 @@
 
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define BEGIN { alloc_frame _frame = {0}; alloc_begin(&_frame, __FILE__, __LINE__);
 #define END alloc_end(); }
 
@@ -10,6 +14,9 @@
 #define RETURN_BASIC(x) do { alloc_end(); return (x); } while(0)
 #define RETURN(x) do { return alloc_return(&(x)->ptr, sizeof *(x)); } while(0)
 
+#define SNAPSHOT_SAVE(x, filename) alloc_snapshot_save(&(x)->ptr, sizeof *(x), (filename))
+#define SNAPSHOT_LOAD(x, filename) alloc_snapshot_load(&(x)->ptr, sizeof *(x), (filename))
+
 
 #ifndef BOOL
 	#define BOOL int
@@ -23,6 +30,12 @@
 	#define FALSE 0
 #endif
 
+// Words after the alloc_ptr in each frame's return value. RETURN(x) needs
+// sizeof *x to fit, which matters for arrays with inline storage.
+#ifndef ALLOC_RETURN_WORDS
+	#define ALLOC_RETURN_WORDS 4
+#endif
+
 
 //
 // The below are implementation details. Do not use them directly.
@@ -36,11 +49,27 @@ typedef struct alloc_ptr {
 typedef struct alloc_frame {
 	struct alloc_frame *next_frame;
 	alloc_ptr *ptr_list;
-	struct { alloc_ptr ptr; size_t other_stuff; } return_value;
+	struct { alloc_ptr ptr; size_t other_stuff[ALLOC_RETURN_WORDS]; } return_value;
 	const char *filename;
 	size_t line_number;
 } alloc_frame;
 
+// The layout of a typed node's data: elements of stride bytes, each with
+// alloc_ptrs at ptr_offsets, which are in increasing order.
+typedef struct alloc_type {
+	size_t stride;
+	size_t ptr_count;
+	const size_t *ptr_offsets;
+} alloc_type;
+
+// A root outside of any frame, for handles that are made and dropped in any
+// order, such as those in alloc.hpp. gc marks from every linked root, which
+// alloc_assign_root assigns to without looking for it.
+typedef struct alloc_root {
+	alloc_ptr ptr;
+	struct alloc_root *prev;
+} alloc_root;
+
 /*
 typedef struct alloc_weak_ptr {
 	struct alloc_ptr ptr;
@@ -54,22 +83,142 @@ void alloc_end();
 
 void* alloc_return(alloc_ptr *ptr, size_t size);
 void* alloc_return_new(size_t size);
+// alloc_return_new with a node laid out as type (see alloc_new_typed). The
+// pending return value comes back even when the node could not be made, with
+// a NULL node.
+void* alloc_return_new_typed(const alloc_type *type, size_t size);
+// whether ptr is the value just returned to the current frame, which the next
+// return will overwrite
+BOOL alloc_is_pending_return(alloc_ptr *ptr);
 
 struct alloc_node* alloc_new(size_t size);
+// A new node laid out as type, in whole elements, with its data zeroed. Its
+// alloc_ptrs are found by that layout rather than being kept in a list, so
+// storing to one does not have to look for the node it is in, and gc, resizes,
+// alloc_move and alloc_clear go through them element by element. alloc_resize
+// zeroes what it adds to a typed node. type must outlive the node. Snapshots
+// load typed nodes as ordinary ones.
+struct alloc_node* alloc_new_typed(const alloc_type *type, size_t size);
 struct alloc_node* alloc_resize(struct alloc_node *node, size_t new_size);
 void* alloc_data(alloc_ptr *ptr);
 size_t alloc_size(alloc_ptr *ptr);
+// Points ptr, which is tracked already, at a node alloc_new, alloc_new_typed or
+// alloc_resize just returned for it, without touching any ref_count. The
+// containers store their nodes with it rather than writing ptr->node, so that
+// recordings see which pointer holds a new node.
+void alloc_set_node(alloc_ptr *ptr, struct alloc_node *node);
 
 void alloc_init(alloc_ptr *ptr, size_t size);
+void alloc_init_typed(alloc_ptr *ptr, const alloc_type *type, size_t size);
+BOOL alloc_is_typed(alloc_ptr *ptr);
+// Marks ptr's node, which is not typed, as one whose user zeroes each alloc_ptr
+// in its data that is not tracked before assigning to it, as the hash maps and
+// deques do with their free slots. alloc_assign then takes a pointer there that
+// has a next to be tracked already, rather than looking for it in the node's
+// list. Resizes and snapshots keep the mark, but resizes do not zero what they
+// add.
+void alloc_keep_zeroed(alloc_ptr *ptr);
 void alloc_assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr);
 
 void alloc_global_assign(alloc_ptr *to_ptr, alloc_ptr *from_ptr);
 
+// alloc_link_root links a root, in constant time whatever the order roots come
+// and go in. A node its ptr holds already is a reference the root takes over,
+// such as that of a node just made. alloc_assign_root is alloc_assign for a
+// linked root. alloc_unlink_root releases its node and unlinks it.
+// alloc_move_root gives to, which is not linked, from's place and node without
+// touching the node, leaving from unlinked and NULL. Roots may outlive the
+// outermost frame, whose end reports unfreed memory apart from what they hold.
+void alloc_link_root(alloc_root *root);
+void alloc_assign_root(alloc_root *root, alloc_ptr *from_ptr);
+void alloc_unlink_root(alloc_root *root);
+void alloc_move_root(alloc_root *to, alloc_root *from);
+
+// whether ptr's node is read-only: interned, or loaded from a snapshot of an
+// interned node. Arrays copy such a node before writing to it.
+BOOL alloc_is_shared(alloc_ptr *ptr);
+// Points ptr at the one node holding these size bytes, which every alloc_intern
+// of the same bytes shares, or at NULL when size is 0 or there is no memory.
+// Interned nodes are read-only, as alloc_is_shared is TRUE for them. Interning
+// does not keep them alive: they are freed like any other node once nothing
+// points at them. Snapshots load them as read-only nodes that are not interned.
+// Only for data without alloc_ptrs in it.
+BOOL alloc_intern(alloc_ptr *ptr, const void *data, size_t size);
+BOOL alloc_is_interned(alloc_ptr *ptr);
+// points ptr at a new node of new_size bytes, starting with size bytes copied
+// from offset in its old node. Only for nodes without alloc_ptrs in their data.
+struct alloc_node* alloc_unshare(alloc_ptr *ptr, size_t offset, size_t size, size_t new_size);
+
+// memmove within a node's data, keeping the alloc_ptrs stored there tracked.
+// Pointers that get overwritten are released, and the part of the source
+// range that was not overwritten is zeroed.
+void alloc_move(alloc_ptr *ptr, size_t to_pos, size_t from_pos, size_t size);
+// releases the alloc_ptrs stored in part of a node's data and zeroes it
+void alloc_clear(alloc_ptr *ptr, size_t pos, size_t size);
+// For containers that move many alloc_ptrs around inside their node at once:
+// alloc_detach_ptrs forgets where they are without releasing them, so they can
+// be moved with plain memcpy, then alloc_attach_ptr tracks each one again at
+// its new place. No other alloc_* call may happen in between.
+void alloc_detach_ptrs(alloc_ptr *ptr);
+void alloc_attach_ptr(alloc_ptr *ptr, alloc_ptr *contained);
+
+// points ptr at a new node holding the whole contents of filename. ptr is
+// NULL after an empty file or a failure.
+BOOL alloc_read_file(alloc_ptr *ptr, const char *filename);
+
+// Use SNAPSHOT_SAVE and SNAPSHOT_LOAD. alloc_snapshot_save writes the nodes
+// reachable from root, with the alloc_ptrs in them stored as node numbers,
+// along with the rest of the size bytes at root. alloc_snapshot_load reads
+// them back into new nodes wherever they land and rebalances the node tree
+// once for all of them. A snapshot is only for the same build on the
+// same platform. root is NULL, and its other bytes zero, after a failure.
+// Loading fails while alloc_record_start is recording.
+BOOL alloc_snapshot_save(alloc_ptr *root, size_t size, const char *filename);
+BOOL alloc_snapshot_load(alloc_ptr *root, size_t size, const char *filename);
+
+// Growth policies for TEMPLATE_ARRAY_EX and TEMPLATE_ARRAY_OBJ_EX. Given the
+// current and needed sizes in bytes, they return the size to grow to.
+size_t alloc_growth_x2(size_t size, size_t needed, size_t element_size);
+size_t alloc_growth_x1_5(size_t size, size_t needed, size_t element_size);
+// doubles, rounding the whole allocation up to a power of two or to whole pages
+size_t alloc_growth_size_class(size_t size, size_t needed, size_t element_size);
+// doubles while that leaves plenty of room under alloc_max_memory_usage, then
+// grows by an eighth. Nodes of at least alloc_mmap_threshold() are remapped, so
+// only their growth counts against that room.
+size_t alloc_growth_near_limit(size_t size, size_t needed, size_t element_size);
+
 void alloc_gc();
+// Nodes of at least min_bytes are mapped on their own, so alloc_resize can
+// grow and shrink them by moving pages instead of copying them, without
+// holding the old and new sizes at once. 1 MiB by default (ALLOC_MMAP_THRESHOLD),
+// SIZE_MAX turns it off. Returns FALSE where there is no mremap.
+BOOL alloc_set_mmap_threshold(size_t min_bytes);
+size_t alloc_mmap_threshold();
 BOOL alloc_set_max_memory_usage(size_t max_bytes);
 size_t alloc_max_memory_usage();
 size_t alloc_memory_usage();
+size_t alloc_peak_memory_usage();
+void alloc_reset_peak_memory_usage();
+size_t alloc_allocation_count();
+// collections run, by alloc_gc or to stay under alloc_max_memory_usage
+size_t alloc_gc_count();
 
 void alloc_debug_info();
 
+// Only record anything when alloc.c is compiled with -DALLOC_TRACE.
+// alloc_trace_dump writes the recorded events as Chrome trace_event JSON,
+// which chrome://tracing and the Perfetto UI both load.
+BOOL alloc_trace_dump(const char *filename);
+void alloc_trace_clear();
+
+// Only record anything when alloc.c is compiled with -DALLOC_RECORD.
+// Logs every alloc_* call until alloc_record_stop to a trace that replay.c
+// can re-execute. Start recording before the outermost BEGIN.
+BOOL alloc_record_start(const char *filename);
+BOOL alloc_record_stop();
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
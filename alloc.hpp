@@ -0,0 +1,525 @@
+#ifndef CONTAINER_ALLOC_HPP
+#define CONTAINER_ALLOC_HPP
+
+//
+// C++17 handles over alloc.c, in place of BEGIN/END/RETURN and the array
+// templates. alloc::array<T> is a growable array and alloc::ptr<T> a single
+// value, each in a node that copies of the handle share, as assigning the C
+// arrays shares theirs. A handle is a root of its own (see alloc_link_root)
+// rather than an alloc_ptr in a frame, so it can be returned by value and kept
+// anywhere, even past the outermost scope as a global. Copying one never has
+// to look for where the handle is, and moving one takes over its place among
+// the roots without touching the node.
+//
+// Elements are either trivially copyable, kept as they are, or handles, kept
+// in a typed node (see alloc_new_typed) as what the handle holds and read back
+// as new handles. Which is picked at compile time. The elements of a leaf
+// array are contiguous, so its iterators are plain pointers, which every
+// allocation may invalidate, as with array_T_raw. find, count and fill go
+// through the kernels in array.c, which <algorithm> on them does not.
+//
+// alloc::scope is a frame for the C functions called while it exists, as
+// BEGIN and END are. Running out of memory throws std::bad_alloc.
+//
+
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "array.h"
+
+namespace alloc {
+
+template<class T> class ptr;
+template<class T> class array;
+
+
+class scope {
+public:
+	explicit scope(const char *filename = "alloc::scope", size_t line_number = 0) noexcept : frame_() {
+		alloc_begin(&frame_, filename, line_number);
+	}
+
+	~scope() {
+		alloc_end();
+	}
+
+	scope(const scope&) = delete;
+	scope &operator=(const scope&) = delete;
+
+private:
+	alloc_frame frame_;
+};
+
+
+namespace detail {
+
+template<class T> struct is_handle : std::false_type {};
+template<class T> struct is_handle<ptr<T>> : std::true_type {};
+template<class T> struct is_handle<array<T>> : std::true_type {};
+template<class T> inline constexpr bool is_handle_v = is_handle<T>::value;
+
+
+// an alloc_root that is linked whenever it holds a node
+class root {
+public:
+	root() noexcept : root_() {}
+	root(const root &other) : root_() { assign(other.get()); }
+	root(root &&other) noexcept : root_() { take(other); }
+	~root() { reset(); }
+
+	root &operator=(const root &other) {
+		assign(other.get());
+		return *this;
+	}
+
+	root &operator=(root &&other) noexcept {
+		if(this != &other) {
+			reset();
+			take(other);
+		}
+
+		return *this;
+	}
+
+	alloc_ptr *get() const noexcept { return const_cast<alloc_ptr*>(&root_.ptr); }
+	struct alloc_node *node() const noexcept { return root_.ptr.node; }
+	void *data() const noexcept { return alloc_data(get()); }
+	size_t size() const noexcept { return alloc_size(get()); }
+
+	// shares the node of from, an alloc_ptr that is tracked wherever it is
+	void assign(alloc_ptr *from) {
+		if(!from->node) {
+			reset();
+			return;
+		}
+
+		if(!root_.ptr.next)
+			alloc_link_root(&root_);
+
+		alloc_assign_root(&root_, from);
+	}
+
+	// holds a node just made, whose one reference nothing holds yet
+	void adopt(struct alloc_node *node) noexcept {
+		reset();
+
+		if(node) {
+			root_.ptr.node = node;
+			alloc_link_root(&root_);
+		}
+	}
+
+	void reset() noexcept {
+		if(root_.ptr.next)
+			alloc_unlink_root(&root_);
+	}
+
+private:
+	void take(root &other) noexcept {
+		if(other.root_.ptr.next)
+			alloc_move_root(&root_, &other.root_);
+	}
+
+	alloc_root root_;
+};
+
+
+// how an array keeps elements of type T in its node
+template<class T, bool = is_handle_v<T>>
+struct element {
+	static_assert(std::is_trivially_copyable_v<T>, "elements are either trivially copyable or alloc handles");
+
+	using stored = T;
+};
+
+template<class T>
+struct element<T, true> {
+	using stored = typename T::stored;
+
+	static constexpr size_t ptr_offsets[1] = { 0 };
+	static constexpr alloc_type layout = { sizeof(stored), 1, ptr_offsets };
+};
+
+
+// Goes through the elements of an array of handles, giving a new handle for
+// each one. Only an input iterator, as there is no element to refer to.
+template<class T>
+class handle_iterator {
+public:
+	using iterator_category = std::input_iterator_tag;
+	using value_type = T;
+	using difference_type = std::ptrdiff_t;
+	using pointer = void;
+	using reference = T;
+
+	explicit handle_iterator(const typename T::stored *pos) noexcept : pos_(pos) {}
+
+	T operator*() const { return T::load(*pos_); }
+
+	handle_iterator &operator++() noexcept {
+		++pos_;
+		return *this;
+	}
+
+	handle_iterator operator++(int) noexcept {
+		handle_iterator old = *this;
+		++pos_;
+		return old;
+	}
+
+	friend bool operator==(const handle_iterator &a, const handle_iterator &b) noexcept { return a.pos_ == b.pos_; }
+	friend bool operator!=(const handle_iterator &a, const handle_iterator &b) noexcept { return a.pos_ != b.pos_; }
+
+private:
+	const typename T::stored *pos_;
+};
+
+}	// namespace detail
+
+
+template<class T>
+class ptr {
+	static_assert(std::is_trivially_copyable_v<T>, "alloc::ptr holds trivially copyable values");
+
+public:
+	// what an array of these keeps for each one
+	struct stored {
+		alloc_ptr ptr;
+	};
+
+	ptr() noexcept = default;
+
+	template<class... Args>
+	static ptr make(Args&&... args) {
+		ptr result;
+		struct alloc_node *node = alloc_new(sizeof(T));
+
+		if(!node)
+			throw std::bad_alloc();
+
+		result.root_.adopt(node);
+		new(result.get()) T(std::forward<Args>(args)...);
+		return result;
+	}
+
+	T *get() const noexcept { return static_cast<T*>(root_.data()); }
+	T &operator*() const noexcept { return *get(); }
+	T *operator->() const noexcept { return get(); }
+	explicit operator bool() const noexcept { return root_.node() != nullptr; }
+	void reset() noexcept { root_.reset(); }
+
+	// the same node, like comparing pointers
+	friend bool operator==(const ptr &a, const ptr &b) noexcept { return a.root_.node() == b.root_.node(); }
+	friend bool operator!=(const ptr &a, const ptr &b) noexcept { return !(a == b); }
+
+private:
+	template<class> friend class array;
+	template<class> friend class detail::handle_iterator;
+
+	static ptr load(const stored &from) {
+		ptr result;
+		result.root_.assign(const_cast<alloc_ptr*>(&from.ptr));
+		return result;
+	}
+
+	void store(stored &to) const {
+		alloc_assign(&to.ptr, root_.get());
+	}
+
+	detail::root root_;
+};
+
+
+template<class T, class... Args>
+ptr<T> make_ptr(Args&&... args) {
+	return ptr<T>::make(std::forward<Args>(args)...);
+}
+
+
+template<class T>
+class array {
+	static constexpr bool holds_handles = detail::is_handle_v<T>;
+	using element = detail::element<T>;
+	using element_stored = typename element::stored;
+
+public:
+	// what an array of these keeps for each one
+	struct stored {
+		alloc_ptr ptr;
+		size_t size;
+	};
+
+	using value_type = T;
+	using size_type = size_t;
+	using iterator = std::conditional_t<holds_handles, detail::handle_iterator<T>, T*>;
+	using const_iterator = std::conditional_t<holds_handles, detail::handle_iterator<T>, const T*>;
+
+	array() noexcept = default;
+
+	// count zeroed elements
+	explicit array(size_t count) {
+		resize(count);
+	}
+
+	array(std::initializer_list<T> values) {
+		reserve(values.size());
+
+		for(const T &value : values)
+			push_back(value);
+	}
+
+	array(const array&) = default;
+	array(array &&other) noexcept : root_(std::move(other.root_)), size_(std::exchange(other.size_, 0)) {}
+	array &operator=(const array&) = default;
+
+	array &operator=(array &&other) noexcept {
+		root_ = std::move(other.root_);
+		size_ = std::exchange(other.size_, 0);
+		return *this;
+	}
+
+	size_t size() const noexcept { return size_; }
+	bool empty() const noexcept { return size_ == 0; }
+	size_t capacity() const noexcept { return root_.size() / sizeof(element_stored); }
+
+	void reserve(size_t count) {
+		if(count > capacity())
+			reallocate(count);
+	}
+
+	void shrink_to_fit() {
+		if(size_ < capacity())
+			reallocate(size_);
+	}
+
+	void resize(size_t count) {
+		if(count <= size_) {
+			truncate(count);
+			return;
+		}
+
+		grow(count);
+
+		// the node of an array of handles is kept zeroed past its elements
+		if constexpr(!holds_handles)
+			std::memset(raw() + size_, 0, (count - size_) * sizeof(T));
+
+		size_ = count;
+	}
+
+	void clear() noexcept { truncate(0); }
+
+	// lets go of the node, which clear keeps
+	void reset() noexcept {
+		root_.reset();
+		size_ = 0;
+	}
+
+	// does nothing to an empty array
+	void pop_back() noexcept {
+		if(size_ > 0)
+			truncate(size_ - 1);
+	}
+
+	void push_back(const T &value) {
+		if constexpr(holds_handles) {
+			grow(size_ + 1);
+			value.store(raw()[size_]);
+		} else {
+			T copy = value;	// value may be one of the elements, which grow moves
+			grow(size_ + 1);
+			raw()[size_] = copy;
+		}
+
+		size_++;
+	}
+
+	// count elements copied from values, which may be in the array itself
+	void append(const T *values, size_t count) {
+		static_assert(!holds_handles, "append copies leaf elements, push_back adds handles");
+
+		if(count == 0)
+			return;
+
+		if(size_ + count > capacity()) {
+			const T *old = raw();
+			size_t from = values >= old && values < old + size_ ? (size_t)(values - old) : ARRAY_NPOS;
+
+			grow(size_ + count);
+
+			if(from != ARRAY_NPOS)
+				values = raw() + from;
+		}
+
+		std::memmove(raw() + size_, values, count * sizeof(T));
+		size_ += count;
+	}
+
+	// a reference to the element in a leaf array, a new handle to it otherwise
+	decltype(auto) operator[](size_t pos) noexcept(!holds_handles) {
+		if constexpr(holds_handles)
+			return T::load(raw()[pos]);
+		else
+			return raw()[pos];
+	}
+
+	decltype(auto) operator[](size_t pos) const noexcept(!holds_handles) {
+		if constexpr(holds_handles)
+			return T::load(raw()[pos]);
+		else
+			return static_cast<const T&>(raw()[pos]);
+	}
+
+	void set(size_t pos, const T &value) {
+		if constexpr(holds_handles)
+			value.store(raw()[pos]);
+		else
+			raw()[pos] = value;
+	}
+
+	// the first element from from on equal to value, or ARRAY_NPOS, comparing
+	// elements by their bytes like array_T_find where that is the same as ==
+	size_t find(const T &value, size_t from = 0) const {
+		static_assert(!holds_handles, "find is for leaf arrays, std::find goes through arrays of handles");
+
+		if(from >= size_)
+			return ARRAY_NPOS;
+
+		if constexpr(std::has_unique_object_representations_v<T>) {
+			size_t pos = array_find_elements(raw() + from, size_ - from, &value, sizeof(T));
+			return pos == ARRAY_NPOS ? pos : from + pos;
+		} else {
+			const T *found = std::find(raw() + from, raw() + size_, value);
+			return found == raw() + size_ ? ARRAY_NPOS : (size_t)(found - raw());
+		}
+	}
+
+	size_t count(const T &value) const {
+		static_assert(!holds_handles, "count is for leaf arrays, std::count goes through arrays of handles");
+
+		if constexpr(std::has_unique_object_representations_v<T>)
+			return size_ ? array_count_elements(raw(), size_, &value, sizeof(T)) : 0;
+		else
+			return std::count(raw(), raw() + size_, value);
+	}
+
+	void fill(const T &value) {
+		static_assert(!holds_handles, "fill is for leaf arrays, set gives each element of an array of handles");
+
+		if(size_)
+			array_fill_elements(raw(), size_, &value, sizeof(T));
+	}
+
+	T *data() noexcept {
+		static_assert(!holds_handles, "an array of handles has no elements to point to");
+		return raw();
+	}
+
+	const T *data() const noexcept {
+		static_assert(!holds_handles, "an array of handles has no elements to point to");
+		return raw();
+	}
+
+	iterator begin() noexcept { return iterator(raw()); }
+	iterator end() noexcept { return iterator(raw() + size_); }
+	const_iterator begin() const noexcept { return const_iterator(raw()); }
+	const_iterator end() const noexcept { return const_iterator(raw() + size_); }
+
+	// compares leaf elements by their bytes, like array_T_equal, where that is
+	// the same as comparing them with ==
+	friend bool operator==(const array &a, const array &b) {
+		if(a.size_ != b.size_)
+			return false;
+
+		if(a.size_ == 0 || a.raw() == b.raw())
+			return true;
+
+		if constexpr(!holds_handles && std::has_unique_object_representations_v<T>)
+			return std::memcmp(a.raw(), b.raw(), a.size_ * sizeof(T)) == 0;
+		else
+			return std::equal(a.begin(), a.end(), b.begin());
+	}
+
+	friend bool operator!=(const array &a, const array &b) { return !(a == b); }
+
+private:
+	template<class> friend class array;
+	template<class> friend class detail::handle_iterator;
+
+	element_stored *raw() const noexcept { return static_cast<element_stored*>(root_.data()); }
+
+	void grow(size_t count) {
+		size_t capacity = this->capacity();
+
+		if(count <= capacity)
+			return;
+
+		capacity = alloc_growth_x2(capacity * sizeof(element_stored), count * sizeof(element_stored), sizeof(element_stored))
+			/ sizeof(element_stored);
+		reallocate(capacity < count ? count : capacity);
+	}
+
+	void reallocate(size_t count) {
+		size_t size = count * sizeof(element_stored);
+
+		if(root_.node()) {
+			struct alloc_node *node = alloc_resize(root_.node(), size);
+
+			if(!node && size > 0)
+				throw std::bad_alloc();
+
+			alloc_set_node(root_.get(), node);
+
+			if(!node)
+				root_.reset();
+		} else if(size > 0) {
+			struct alloc_node *node;
+
+			if constexpr(holds_handles)
+				node = alloc_new_typed(&element::layout, size);
+			else
+				node = alloc_new(size);
+
+			if(!node)
+				throw std::bad_alloc();
+
+			root_.adopt(node);
+		}
+
+		if(size_ > count)
+			size_ = count;
+	}
+
+	// drops the elements from count on, releasing what handles they hold
+	void truncate(size_t count) noexcept {
+		if constexpr(holds_handles) {
+			if(count < size_)
+				alloc_clear(root_.get(), count * sizeof(element_stored), (size_ - count) * sizeof(element_stored));
+		}
+
+		size_ = count;
+	}
+
+	static array load(const stored &from) {
+		array result;
+		result.root_.assign(const_cast<alloc_ptr*>(&from.ptr));
+		result.size_ = result.root_.node() ? from.size : 0;
+		return result;
+	}
+
+	void store(stored &to) const {
+		alloc_assign(&to.ptr, root_.get());
+		to.size = size_;
+	}
+
+	detail::root root_;
+	size_t size_ = 0;
+};
+
+}	// namespace alloc
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef CONTAINER_ALLOC_RECORD_H
+#define CONTAINER_ALLOC_RECORD_H
+
+//
+// Format of the allocation traces written by alloc_record_start() and read by replay.c.
+//
+// A trace is ALLOC_RECORD_MAGIC followed by one record per public alloc_* call:
+// an opcode byte, then its operands as unsigned LEB128 varints. Nodes are
+// identified by their address at recording time. A pointer operand is a
+// alloc_record_ref kind followed by that kind's operands.
+//
+
+#define ALLOC_RECORD_MAGIC "ALLOCRC1"
+#define ALLOC_RECORD_MAGIC_SIZE 8
+
+typedef enum alloc_record_op {
+	RECORD_BEGIN = 1,
+	RECORD_END,
+	RECORD_RETURN,			// ptr, ptr's node, size
+	RECORD_RETURN_NEW,		// size, new node
+	RECORD_NEW,				// size, new node
+	RECORD_RESIZE,			// node, new size, new node
+	RECORD_INIT,			// ptr, size, new node
+	RECORD_ASSIGN,			// to ptr, to ptr's node, whether to ptr is linked, from ptr, from ptr's node
+	RECORD_GLOBAL_ASSIGN,	// (same as RECORD_ASSIGN)
+	RECORD_GC,
+	RECORD_SET_MAX_MEMORY,	// max bytes
+	RECORD_UNSHARE,			// ptr, ptr's node, offset, size, new size, new node
+	RECORD_MOVE,			// ptr, ptr's node, to pos, from pos, size
+	RECORD_CLEAR,			// ptr, ptr's node, pos, size
+	RECORD_DETACH_PTRS,		// ptr, ptr's node
+	RECORD_ATTACH_PTR,		// ptr, ptr's node, contained ptr, contained ptr's node
+	RECORD_SET_MMAP_THRESHOLD,	// min bytes
+	RECORD_NEW_TYPED,		// stride, alloc_ptr count, each alloc_ptr's offset, size, new node
+	RECORD_INTERN,			// ptr, ptr's node, size, then that many bytes as they are, interned node
+	RECORD_LINK_ROOT,		// root's ptr, its node
+	RECORD_UNLINK_ROOT,		// root's ptr, its node
+	RECORD_MOVE_ROOT,		// to root's ptr, from root's ptr, from root's node
+	RECORD_SET_NODE,		// ptr, node
+	RECORD_INIT_TYPED,		// ptr, stride, alloc_ptr count, each alloc_ptr's offset, size, new node
+	RECORD_RETURN_NEW_TYPED,	// stride, alloc_ptr count, each alloc_ptr's offset, size, new node
+	RECORD_KEEP_ZEROED,		// ptr, ptr's node
+	RECORD_ASSIGN_ROOT		// root's ptr, its node, from ptr, from ptr's node
+} alloc_record_op;
+
+typedef enum alloc_record_ref {
+	RECORD_REF_NULL,		// no operands
+	RECORD_REF_NODE,		// containing node, offset into the node's data
+	RECORD_REF_RETURN,		// frame depth, where 0 is the current frame
+	RECORD_REF_OTHER		// address of a stack or static alloc_ptr
+} alloc_record_ref;
+
+#endif
@@ -0,0 +1,250 @@
+//
+// Bulk kernels behind array_T_find, count and fill (see array.h).
+//
+// Element sizes of 2, 4 and 8 bytes are compared 16 or 32 bytes at a time with
+// SSE2 or AVX2, picked at run time; single bytes go through memchr and memset.
+// Other sizes fall back to an element-by-element memcmp.
+//
+
+#include <string.h>
+#include "array.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define ARRAY_X86
+#include <immintrin.h>
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+
+static size_t find_scalar(const unsigned char *data, size_t count, const void *value, size_t size) {
+	for(size_t i = 0; i < count; i++) {
+		if(memcmp(data + i * size, value, size) == 0)
+			return i;
+	}
+
+	return ARRAY_NPOS;
+}
+
+
+static size_t count_scalar(const unsigned char *data, size_t count, const void *value, size_t size) {
+	size_t matches = 0;
+
+	for(size_t i = 0; i < count; i++)
+		matches += memcmp(data + i * size, value, size) == 0;
+
+	return matches;
+}
+
+
+#ifdef ARRAY_X86
+
+static BOOL has_avx2() {
+	static int avx2 = -1;
+
+	if(avx2 < 0) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2") != 0;
+	}
+
+	return avx2;
+}
+
+
+// value repeated across a whole vector
+static void splat(unsigned char *pattern, size_t pattern_size, const void *value, size_t size) {
+	for(size_t i = 0; i < pattern_size; i += size)
+		memcpy(pattern + i, value, size);
+}
+
+
+// one bit per byte, set for every byte of each matching element
+static inline unsigned match_sse2(__m128i block, __m128i pattern, size_t size) {
+	__m128i equal;
+
+	switch(size) {
+	case 1: equal = _mm_cmpeq_epi8(block, pattern); break;
+	case 2: equal = _mm_cmpeq_epi16(block, pattern); break;
+	case 4: equal = _mm_cmpeq_epi32(block, pattern); break;
+	default:
+		// SSE2 has no 64-bit compare, so both halves have to match
+		equal = _mm_cmpeq_epi32(block, pattern);
+		equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+		break;
+	}
+
+	return (unsigned)_mm_movemask_epi8(equal);
+}
+
+
+TARGET_AVX2 static inline unsigned match_avx2(__m256i block, __m256i pattern, size_t size) {
+	__m256i equal;
+
+	switch(size) {
+	case 1: equal = _mm256_cmpeq_epi8(block, pattern); break;
+	case 2: equal = _mm256_cmpeq_epi16(block, pattern); break;
+	case 4: equal = _mm256_cmpeq_epi32(block, pattern); break;
+	default: equal = _mm256_cmpeq_epi64(block, pattern); break;
+	}
+
+	return (unsigned)_mm256_movemask_epi8(equal);
+}
+
+
+static inline size_t find_sse2(const unsigned char *data, size_t count, const void *value, size_t size) {
+	unsigned char bytes[16];
+	size_t end = count * size;
+	size_t i = 0;
+
+	splat(bytes, sizeof bytes, value, size);
+	__m128i pattern = _mm_loadu_si128((const __m128i*)bytes);
+
+	for(; i + 16 <= end; i += 16) {
+		unsigned mask = match_sse2(_mm_loadu_si128((const __m128i*)(data + i)), pattern, size);
+
+		if(mask)
+			return (i + __builtin_ctz(mask)) / size;
+	}
+
+	size_t pos = find_scalar(data + i, (end - i) / size, value, size);
+	return pos == ARRAY_NPOS ? ARRAY_NPOS : i / size + pos;
+}
+
+
+TARGET_AVX2 static inline size_t find_avx2(const unsigned char *data, size_t count, const void *value, size_t size) {
+	unsigned char bytes[32];
+	size_t end = count * size;
+	size_t i = 0;
+
+	splat(bytes, sizeof bytes, value, size);
+	__m256i pattern = _mm256_loadu_si256((const __m256i*)bytes);
+
+	for(; i + 32 <= end; i += 32) {
+		unsigned mask = match_avx2(_mm256_loadu_si256((const __m256i*)(data + i)), pattern, size);
+
+		if(mask)
+			return (i + __builtin_ctz(mask)) / size;
+	}
+
+	size_t pos = find_scalar(data + i, (end - i) / size, value, size);
+	return pos == ARRAY_NPOS ? ARRAY_NPOS : i / size + pos;
+}
+
+
+static inline size_t count_sse2(const unsigned char *data, size_t count, const void *value, size_t size) {
+	unsigned char bytes[16];
+	size_t end = count * size;
+	size_t matching_bytes = 0;
+	size_t i = 0;
+
+	splat(bytes, sizeof bytes, value, size);
+	__m128i pattern = _mm_loadu_si128((const __m128i*)bytes);
+
+	for(; i + 16 <= end; i += 16)
+		matching_bytes += __builtin_popcount(match_sse2(_mm_loadu_si128((const __m128i*)(data + i)), pattern, size));
+
+	return matching_bytes / size + count_scalar(data + i, (end - i) / size, value, size);
+}
+
+
+TARGET_AVX2 static inline size_t count_avx2(const unsigned char *data, size_t count, const void *value, size_t size) {
+	unsigned char bytes[32];
+	size_t end = count * size;
+	size_t matching_bytes = 0;
+	size_t i = 0;
+
+	splat(bytes, sizeof bytes, value, size);
+	__m256i pattern = _mm256_loadu_si256((const __m256i*)bytes);
+
+	for(; i + 32 <= end; i += 32)
+		matching_bytes += __builtin_popcount(match_avx2(_mm256_loadu_si256((const __m256i*)(data + i)), pattern, size));
+
+	return matching_bytes / size + count_scalar(data + i, (end - i) / size, value, size);
+}
+
+
+// the kernels above with the element size fixed, so that match_* folds to a single compare
+#define FIND_KERNELS(size)																			\
+	static size_t find_sse2_##size(const unsigned char *data, size_t count, const void *value) {		\
+		return find_sse2(data, count, value, size);													\
+	}																								\
+																									\
+	TARGET_AVX2 static size_t find_avx2_##size(const unsigned char *data, size_t count, const void *value) {	\
+		return find_avx2(data, count, value, size);													\
+	}
+
+#define COUNT_KERNELS(size)																			\
+	static size_t count_sse2_##size(const unsigned char *data, size_t count, const void *value) {	\
+		return count_sse2(data, count, value, size);												\
+	}																								\
+																									\
+	TARGET_AVX2 static size_t count_avx2_##size(const unsigned char *data, size_t count, const void *value) {	\
+		return count_avx2(data, count, value, size);												\
+	}
+
+FIND_KERNELS(2)
+FIND_KERNELS(4)
+FIND_KERNELS(8)
+
+COUNT_KERNELS(1)
+COUNT_KERNELS(2)
+COUNT_KERNELS(4)
+COUNT_KERNELS(8)
+
+#endif
+
+
+size_t array_find_elements(const void *data, size_t count, const void *value, size_t size) {
+	if(size == 1) {
+		const unsigned char *found = memchr(data, *(const unsigned char*)value, count);
+		return found ? (size_t)(found - (const unsigned char*)data) : ARRAY_NPOS;
+	}
+
+#ifdef ARRAY_X86
+	BOOL avx2 = has_avx2();
+
+	switch(size) {
+	case 2: return avx2 ? find_avx2_2(data, count, value) : find_sse2_2(data, count, value);
+	case 4: return avx2 ? find_avx2_4(data, count, value) : find_sse2_4(data, count, value);
+	case 8: return avx2 ? find_avx2_8(data, count, value) : find_sse2_8(data, count, value);
+	}
+#endif
+
+	return find_scalar(data, count, value, size);
+}
+
+
+size_t array_count_elements(const void *data, size_t count, const void *value, size_t size) {
+#ifdef ARRAY_X86
+	BOOL avx2 = has_avx2();
+
+	switch(size) {
+	case 1: return avx2 ? count_avx2_1(data, count, value) : count_sse2_1(data, count, value);
+	case 2: return avx2 ? count_avx2_2(data, count, value) : count_sse2_2(data, count, value);
+	case 4: return avx2 ? count_avx2_4(data, count, value) : count_sse2_4(data, count, value);
+	case 8: return avx2 ? count_avx2_8(data, count, value) : count_sse2_8(data, count, value);
+	}
+#endif
+
+	return count_scalar(data, count, value, size);
+}
+
+
+void array_fill_elements(void *data, size_t count, const void *value, size_t size) {
+	unsigned char *bytes = data;
+	size_t end = count * size;
+
+	if(count == 0)
+		return;
+
+	if(size == 1) {
+		memset(data, *(const unsigned char*)value, count);
+		return;
+	}
+
+	// write one element, then keep doubling the filled prefix with memcpy
+	memcpy(bytes, value, size);
+
+	for(size_t filled = size; filled < end; filled *= 2)
+		memcpy(bytes + filled, bytes, filled < end - filled ? filled : end - filled);
+}
@@ -1,8 +1,21 @@
 #ifndef CONTAINER_ARRAY_H
 #define CONTAINER_ARRAY_H
 
+#include <string.h>
 #include "alloc.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARRAY_NPOS ((size_t)-1)
+
+// Bulk kernels for leaf arrays, implemented in array.c. Elements are compared
+// by their bytes, so e.g. 0.0 and -0.0 differ and a NaN can be found.
+size_t array_find_elements(const void *data, size_t count, const void *value, size_t size);
+size_t array_count_elements(const void *data, size_t count, const void *value, size_t size);
+void array_fill_elements(void *data, size_t count, const void *value, size_t size);
+
 #define ARRAY_INIT_NULL(type, name) \
 	array_##type name = { 0 }
 
@@ -11,16 +24,26 @@
 	array_##type##_init(name, elements, reserved)		
 
 
-#define TEMPLATE_ARRAY(type) 													\
+#define TEMPLATE_ARRAY(type) TEMPLATE_ARRAY_EX(type, alloc_growth_x2)
+#define TEMPLATE_ARRAY_SMALL(type, inline_count) TEMPLATE_ARRAY_SMALL_EX(type, inline_count, alloc_growth_x2)
+#define TEMPLATE_ARRAY_OBJ(type) TEMPLATE_ARRAY_OBJ_EX(type, alloc_growth_x2)
+
+
+// policy is a function with the signature of alloc_growth_x2 (see alloc.h)
+#define TEMPLATE_ARRAY_EX(type, policy) \
 	typedef struct internal_array_##type {										\
 		alloc_ptr ptr;															\
 		size_t elements_used;													\
+		size_t offset;	/* of the first element in the node, for slices */		\
+		BOOL view;	/* a slice or the array it came from, see slice */			\
 	} array_##type[1], *ret_array_##type;										\
 																				\
 	static void array_##type##_init(array_##type var, size_t elements, size_t reserved) {		\
 		if(reserved < elements)													\
 			reserved = elements;												\
 		alloc_init(&var->ptr, reserved * sizeof(type));							\
+		var->offset = 0;														\
+		var->view = FALSE;														\
 		if(var->ptr.node)														\
 			var->elements_used = elements;										\
 		else																	\
@@ -29,8 +52,11 @@
 																				\
 	static ret_array_##type array_##type##_new(size_t elements) {				\
 		ret_array_##type ret = alloc_return_new(elements * sizeof(type));		\
-		if(ret)																	\
+		if(ret) {																\
 			ret->elements_used = elements;										\
+			ret->offset = 0;													\
+			ret->view = FALSE;													\
+		}																		\
 		return ret;																\
 	}																			\
 																				\
@@ -38,9 +64,13 @@
 		if(from) {																\
 			alloc_assign(&to->ptr, &from->ptr);									\
 			to->elements_used = from->elements_used;							\
+			to->offset = from->offset;											\
+			to->view = from->view;												\
 		} else {																\
 			alloc_assign(&to->ptr, NULL);										\
 			to->elements_used = 0;												\
+			to->offset = 0;														\
+			to->view = FALSE;													\
 		}																		\
 	}																			\
 																				\
@@ -48,32 +78,457 @@
 		if(from) {																\
 			alloc_global_assign(&to->ptr, &from->ptr);							\
 			to->elements_used = from->elements_used;							\
+			to->offset = from->offset;											\
+			to->view = from->view;												\
 		} else {																\
 			alloc_global_assign(&to->ptr, NULL);								\
 			to->elements_used = 0;												\
+			to->offset = 0;														\
+			to->view = FALSE;													\
 		}																		\
 	}																			\
 																				\
 	static type* array_##type##_raw(array_##type var) {							\
-		return alloc_data(&var->ptr);											\
+		return var->ptr.node ? (type*)alloc_data(&var->ptr) + var->offset : NULL;	\
 	}																			\
 																				\
 	static size_t array_##type##_size(array_##type var) {						\
 		return var->elements_used;												\
 	}																			\
 																				\
-	static BOOL array_##type##_add(array_##type var, type element) {			\
-		size_t size = alloc_size(&var->ptr);									\
-		if(var->elements_used * sizeof(type) == alloc_size(&var->ptr)) {		\
-			struct alloc_node *new_node = alloc_resize(var->ptr.node, (size + sizeof(type)) * 2);\
-			if(!new_node)														\
+	static size_t array_##type##_capacity(array_##type var) {					\
+		return var->ptr.node ? alloc_size(&var->ptr) / sizeof(type) - var->offset : 0;	\
+	}																			\
+																				\
+	static BOOL array_##type##_realloc(array_##type var, size_t elements) {		\
+		if(!var->ptr.node && elements == 0)										\
+			return TRUE;														\
+		if(var->ptr.node && (var->view || alloc_is_shared(&var->ptr))) {		\
+			size_t used = var->elements_used < elements ? var->elements_used : elements;	\
+			if(!alloc_unshare(&var->ptr, var->offset * sizeof(type), used * sizeof(type), elements * sizeof(type)) && elements > 0)	\
 				return FALSE;													\
-			var->ptr.node = new_node;											\
+			var->offset = 0;													\
+			var->view = FALSE;													\
+			return TRUE;														\
+		}																		\
+		struct alloc_node *new_node = alloc_resize(var->ptr.node, elements * sizeof(type));	\
+		if(elements > 0 && !new_node)											\
+			return FALSE;														\
+		alloc_set_node(&var->ptr, new_node);									\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_unshare(array_##type var) {						\
+		if(!var->view && !alloc_is_shared(&var->ptr))							\
+			return TRUE;														\
+		size_t size = var->elements_used * sizeof(type);						\
+		if(!alloc_unshare(&var->ptr, var->offset * sizeof(type), size, size) && size > 0)	\
+			return FALSE;														\
+		var->offset = 0;														\
+		var->view = FALSE;														\
+		return TRUE;															\
+	}																			\
+																				\
+	/* dst views count elements of src from pos without copying them; after this */	\
+	/* both, and the arrays assigned from either, copy before writing, except */	\
+	/* through raw. Arrays that already shared src's node write to it in place. */	\
+	static BOOL array_##type##_slice(array_##type dst, array_##type src, size_t pos, size_t count) {	\
+		if(pos > src->elements_used || count > src->elements_used - pos)		\
+			return FALSE;														\
+		size_t offset = src->ptr.node ? src->offset + pos : 0;					\
+		src->view = src->ptr.node != NULL;										\
+		array_##type##_assign(dst, src);										\
+		dst->offset = offset;													\
+		dst->elements_used = count;												\
+		return TRUE;															\
+	}																			\
+																				\
+	/* the contents of filename, as many whole elements as it holds */			\
+	static BOOL array_##type##_read_file(array_##type var, const char *filename) {	\
+		BOOL success = alloc_read_file(&var->ptr, filename);					\
+		var->offset = 0;														\
+		var->view = FALSE;														\
+		var->elements_used = alloc_size(&var->ptr) / sizeof(type);				\
+		return success;															\
+	}																			\
+																				\
+	/* whether var is the whole of an interned node, which no array with */		\
+	/* other elements shares */													\
+	static BOOL array_##type##_is_interned(array_##type var) {					\
+		return alloc_is_interned(&var->ptr) && var->elements_used * sizeof(type) == alloc_size(&var->ptr);	\
+	}																			\
+																				\
+	/* dst shares one read-only node with every array interned with the same */	\
+	/* elements as src, see alloc_intern. dst is empty on failure. */			\
+	static BOOL array_##type##_intern(array_##type dst, array_##type src) {		\
+		size_t count = src->elements_used;										\
+		if(array_##type##_is_interned(src)) {									\
+			array_##type##_assign(dst, src);									\
+			return TRUE;														\
+		}																		\
+		BOOL success = alloc_intern(&dst->ptr, array_##type##_raw(src), count * sizeof(type));	\
+		if(dst->ptr.node) {														\
+			dst->offset = 0;													\
+			dst->view = FALSE;													\
 		}																		\
+		dst->elements_used = dst->ptr.node ? count : 0;							\
+		return success;															\
+	}																			\
+																				\
+	INTERNAL_ARRAY_FUNCTIONS(type, policy)
+
+
+
+// Like TEMPLATE_ARRAY, but up to inline_count elements are stored in the array
+// itself, so short arrays need no node. The elements move to a node when the
+// array grows past inline_count, or when it is assigned somewhere, so that
+// assignment keeps sharing the elements; assigning the value a function just
+// returned copies it instead. RETURN needs the whole array to fit in the
+// frame's return value, see ALLOC_RETURN_WORDS.
+#define TEMPLATE_ARRAY_SMALL_EX(type, inline_count, policy) \
+	typedef struct internal_array_##type {										\
+		alloc_ptr ptr;															\
+		size_t elements_used;													\
+		union {																	\
+			struct {															\
+				size_t offset;													\
+				BOOL view;														\
+			} in_node;	/* as for TEMPLATE_ARRAY, while the elements are in a node */	\
+			type elements[inline_count];										\
+		} storage;																\
+	} array_##type[1], *ret_array_##type;										\
+																				\
+	typedef char array_##type##_inline_count_exceeds_ALLOC_RETURN_WORDS[		\
+		sizeof(struct internal_array_##type) <= sizeof(((alloc_frame*)0)->return_value) ? 1 : -1];	\
+																				\
+	static void array_##type##_init(array_##type var, size_t elements, size_t reserved) {	\
+		if(reserved < elements)													\
+			reserved = elements;												\
+		alloc_init(&var->ptr, reserved <= (inline_count) ? 0 : reserved * sizeof(type));	\
+		if(var->ptr.node) {														\
+			var->storage.in_node.offset = 0;									\
+			var->storage.in_node.view = FALSE;									\
+		}																		\
+		if(var->ptr.node || reserved <= (inline_count))							\
+			var->elements_used = elements;										\
+		else																	\
+			var->elements_used = 0;												\
+	}																			\
+																				\
+	static ret_array_##type array_##type##_new(size_t elements) {				\
+		ret_array_##type ret = alloc_return_new(elements <= (inline_count) ? 0 : elements * sizeof(type));	\
+		if(ret) {																\
+			ret->elements_used = elements;										\
+			if(ret->ptr.node) {													\
+				ret->storage.in_node.offset = 0;								\
+				ret->storage.in_node.view = FALSE;								\
+			}																	\
+		}																		\
+		return ret;																\
+	}																			\
+																				\
+	static BOOL array_##type##_promote(array_##type var, size_t elements) {		\
+		struct alloc_node *new_node = alloc_resize(NULL, elements * sizeof(type));	\
+		if(!new_node)															\
+			return FALSE;														\
+		alloc_set_node(&var->ptr, new_node);									\
+		memcpy(alloc_data(&var->ptr), var->storage.elements, var->elements_used * sizeof(type));	\
+		var->storage.in_node.offset = 0;										\
+		var->storage.in_node.view = FALSE;										\
+		return TRUE;															\
+	}																			\
+																				\
+	static void array_##type##_share(array_##type to, array_##type from, void (*assign)(alloc_ptr*, alloc_ptr*)) {	\
+		if(!from) {																\
+			assign(&to->ptr, NULL);												\
+			to->elements_used = 0;												\
+			return;																\
+		}																		\
+		if(!from->ptr.node && from->elements_used > 0 && from != to && !alloc_is_pending_return(&from->ptr))	\
+			array_##type##_promote(from, (inline_count));						\
+		if(from->ptr.node) {													\
+			assign(&to->ptr, &from->ptr);										\
+			to->storage.in_node = from->storage.in_node;						\
+		} else {																\
+			assign(&to->ptr, NULL);												\
+			memmove(to->storage.elements, from->storage.elements, from->elements_used * sizeof(type));	\
+		}																		\
+		to->elements_used = from->elements_used;								\
+	}																			\
+																				\
+	static void array_##type##_assign(array_##type to, array_##type from) {		\
+		array_##type##_share(to, from, alloc_assign);							\
+	}																			\
+																				\
+	static void array_##type##_global_assign(array_##type to, array_##type from) {	\
+		array_##type##_share(to, from, alloc_global_assign);					\
+	}																			\
+																				\
+	static type* array_##type##_raw(array_##type var) {							\
+		return var->ptr.node ? (type*)alloc_data(&var->ptr) + var->storage.in_node.offset : var->storage.elements;	\
+	}																			\
+																				\
+	static size_t array_##type##_size(array_##type var) {						\
+		return var->elements_used;												\
+	}																			\
+																				\
+	static size_t array_##type##_capacity(array_##type var) {					\
+		return var->ptr.node ? alloc_size(&var->ptr) / sizeof(type) - var->storage.in_node.offset : (inline_count);	\
+	}																			\
+																				\
+	static BOOL array_##type##_realloc(array_##type var, size_t elements) {		\
+		if(!var->ptr.node)														\
+			return elements <= (inline_count) || array_##type##_promote(var, elements);	\
+		if(var->storage.in_node.view || alloc_is_shared(&var->ptr)) {			\
+			size_t used = var->elements_used < elements ? var->elements_used : elements;	\
+			if(!alloc_unshare(&var->ptr, var->storage.in_node.offset * sizeof(type), used * sizeof(type), elements * sizeof(type)) && elements > 0)	\
+				return FALSE;													\
+			var->storage.in_node.offset = 0;									\
+			var->storage.in_node.view = FALSE;									\
+			return TRUE;														\
+		}																		\
+		struct alloc_node *new_node = alloc_resize(var->ptr.node, elements * sizeof(type));	\
+		if(elements > 0 && !new_node)											\
+			return FALSE;														\
+		alloc_set_node(&var->ptr, new_node);									\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_unshare(array_##type var) {						\
+		if(!var->ptr.node || (!var->storage.in_node.view && !alloc_is_shared(&var->ptr)))	\
+			return TRUE;														\
+		size_t size = var->elements_used * sizeof(type);						\
+		if(!alloc_unshare(&var->ptr, var->storage.in_node.offset * sizeof(type), size, size) && size > 0)	\
+			return FALSE;														\
+		var->storage.in_node.offset = 0;										\
+		var->storage.in_node.view = FALSE;										\
+		return TRUE;															\
+	}																			\
+																				\
+	/* as for TEMPLATE_ARRAY, but slices of inline elements are copied */		\
+	static BOOL array_##type##_slice(array_##type dst, array_##type src, size_t pos, size_t count) {	\
+		if(pos > src->elements_used || count > src->elements_used - pos)		\
+			return FALSE;														\
+		if(src->ptr.node) {														\
+			size_t offset = src->storage.in_node.offset + pos;					\
+			src->storage.in_node.view = TRUE;									\
+			array_##type##_assign(dst, src);									\
+			dst->storage.in_node.offset = offset;								\
+		} else {																\
+			alloc_assign(&dst->ptr, NULL);										\
+			memmove(dst->storage.elements, src->storage.elements + pos, count * sizeof(type));	\
+		}																		\
+		dst->elements_used = count;												\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_read_file(array_##type var, const char *filename) {	\
+		BOOL success = alloc_read_file(&var->ptr, filename);					\
+		if(var->ptr.node) {														\
+			var->storage.in_node.offset = 0;									\
+			var->storage.in_node.view = FALSE;									\
+		}																		\
+		var->elements_used = alloc_size(&var->ptr) / sizeof(type);				\
+		return success;															\
+	}																			\
+																				\
+	/* whether var is the whole of an interned node, which no array with */		\
+	/* other elements shares */													\
+	static BOOL array_##type##_is_interned(array_##type var) {					\
+		return alloc_is_interned(&var->ptr) && var->elements_used * sizeof(type) == alloc_size(&var->ptr);	\
+	}																			\
+																				\
+	/* dst shares one read-only node with every array interned with the same */	\
+	/* elements as src, see alloc_intern. dst is empty on failure. */			\
+	static BOOL array_##type##_intern(array_##type dst, array_##type src) {		\
+		size_t count = src->elements_used;										\
+		if(array_##type##_is_interned(src)) {									\
+			array_##type##_assign(dst, src);									\
+			return TRUE;														\
+		}																		\
+		BOOL success = alloc_intern(&dst->ptr, array_##type##_raw(src), count * sizeof(type));	\
+		if(dst->ptr.node) {														\
+			dst->storage.in_node.offset = 0;									\
+			dst->storage.in_node.view = FALSE;									\
+		}																		\
+		dst->elements_used = dst->ptr.node ? count : 0;							\
+		return success;															\
+	}																			\
+																				\
+	INTERNAL_ARRAY_FUNCTIONS(type, policy)
+
+
+
+// the functions TEMPLATE_ARRAY_EX and TEMPLATE_ARRAY_SMALL_EX share
+#define INTERNAL_ARRAY_FUNCTIONS(type, policy) \
+	static BOOL array_##type##_grow(array_##type var, size_t elements) {		\
+		size_t capacity = array_##type##_capacity(var);							\
+		if(elements <= capacity)												\
+			return TRUE;														\
+		capacity = policy(capacity * sizeof(type), elements * sizeof(type), sizeof(type)) / sizeof(type);	\
+		return array_##type##_realloc(var, capacity < elements ? elements : capacity);	\
+	}																			\
+																				\
+	static BOOL array_##type##_reserve(array_##type var, size_t elements) {		\
+		if(elements <= array_##type##_capacity(var))							\
+			return TRUE;														\
+		return array_##type##_realloc(var, elements);							\
+	}																			\
+																				\
+	static BOOL array_##type##_shrink_to_fit(array_##type var) {				\
+		if(var->elements_used == array_##type##_capacity(var) || alloc_is_shared(&var->ptr))	\
+			return TRUE;														\
+		return array_##type##_realloc(var, var->elements_used);					\
+	}																			\
+																				\
+	static BOOL array_##type##_add(array_##type var, type element) {			\
+		if(!array_##type##_unshare(var) || !array_##type##_grow(var, var->elements_used + 1))	\
+			return FALSE;														\
 		array_##type##_raw(var)[var->elements_used++] = element;				\
 		return TRUE;															\
 	}																			\
 																				\
+	/* the index of the element p points to, ARRAY_NPOS if it is not */			\
+	/* one of var's, so that a copy from var itself finds its source */			\
+	/* again once var has grown */												\
+	static size_t array_##type##_index_of(array_##type var, const type *p) {	\
+		const type *data = array_##type##_raw(var);								\
+		return p >= data && p < data + var->elements_used ? (size_t)(p - data) : ARRAY_NPOS;	\
+	}																			\
+																				\
+	/* elements may be var's own */												\
+	static BOOL array_##type##_append_n(array_##type var, const type *elements, size_t count) {	\
+		size_t from = array_##type##_index_of(var, elements);					\
+		if(!array_##type##_unshare(var) || !array_##type##_grow(var, var->elements_used + count))	\
+			return FALSE;														\
+		if(from != ARRAY_NPOS)													\
+			elements = array_##type##_raw(var) + from;							\
+		if(count > 0)															\
+			memcpy(array_##type##_raw(var) + var->elements_used, elements, count * sizeof(type));	\
+		var->elements_used += count;											\
+		return TRUE;															\
+	}																			\
+																				\
+	/* elements may be var's own */												\
+	static BOOL array_##type##_insert_range(array_##type var, size_t pos, const type *elements, size_t count) {	\
+		size_t from = array_##type##_index_of(var, elements);					\
+		if(pos > var->elements_used || !array_##type##_unshare(var) || !array_##type##_grow(var, var->elements_used + count))	\
+			return FALSE;														\
+		if(count > 0) {															\
+			type *data = array_##type##_raw(var);								\
+			memmove(data + pos + count, data + pos, (var->elements_used - pos) * sizeof(type));	\
+			if(from == ARRAY_NPOS)												\
+				memcpy(data + pos, elements, count * sizeof(type));				\
+			else {																\
+				/* the part of elements from pos on was just moved up by count */	\
+				size_t before = from >= pos ? 0 : pos - from < count ? pos - from : count;	\
+				memcpy(data + pos, data + from, before * sizeof(type));			\
+				memcpy(data + pos + before, data + from + before + count, (count - before) * sizeof(type));	\
+			}																	\
+			var->elements_used += count;										\
+		}																		\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_erase_range(array_##type var, size_t pos, size_t count) {	\
+		if(pos > var->elements_used)											\
+			return FALSE;														\
+		if(count > var->elements_used - pos)									\
+			count = var->elements_used - pos;									\
+		if(pos + count < var->elements_used && !array_##type##_unshare(var))	\
+			return FALSE;														\
+		if(count > 0) {															\
+			type *data = array_##type##_raw(var);								\
+			memmove(data + pos, data + pos + count, (var->elements_used - pos - count) * sizeof(type));	\
+			var->elements_used -= count;										\
+		}																		\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_resize(array_##type var, size_t elements) {		\
+		if(elements > var->elements_used) {										\
+			if(!array_##type##_unshare(var) || !array_##type##_grow(var, elements))	\
+				return FALSE;													\
+			memset(array_##type##_raw(var) + var->elements_used, 0, (elements - var->elements_used) * sizeof(type));	\
+		}																		\
+		var->elements_used = elements;											\
+		return TRUE;															\
+	}																			\
+																				\
+	static void array_##type##_clear(array_##type var) {						\
+		var->elements_used = 0;													\
+	}																			\
+																				\
+	static size_t array_##type##_find(array_##type var, type value, size_t from) {	\
+		if(from >= var->elements_used)											\
+			return ARRAY_NPOS;													\
+		size_t pos = array_find_elements(array_##type##_raw(var) + from, var->elements_used - from, &value, sizeof(type));	\
+		return pos == ARRAY_NPOS ? ARRAY_NPOS : from + pos;						\
+	}																			\
+																				\
+	static size_t array_##type##_count(array_##type var, type value) {			\
+		if(var->elements_used == 0)												\
+			return 0;															\
+		return array_count_elements(array_##type##_raw(var), var->elements_used, &value, sizeof(type));	\
+	}																			\
+																				\
+	static BOOL array_##type##_equal(array_##type a, array_##type b) {			\
+		if(a->elements_used != b->elements_used)								\
+			return FALSE;														\
+		if(a->elements_used == 0 || array_##type##_raw(a) == array_##type##_raw(b))	\
+			return TRUE;														\
+		if(array_##type##_is_interned(a) && array_##type##_is_interned(b))		\
+			return FALSE;														\
+		return memcmp(array_##type##_raw(a), array_##type##_raw(b), a->elements_used * sizeof(type)) == 0;	\
+	}																			\
+																				\
+	/* orders by bytes like memcmp, then shorter first; not by the value of type */	\
+	static int array_##type##_compare(array_##type a, array_##type b) {			\
+		size_t common = a->elements_used < b->elements_used ? a->elements_used : b->elements_used;	\
+		int result = 0;															\
+		if(common > 0 && array_##type##_raw(a) != array_##type##_raw(b))		\
+			result = memcmp(array_##type##_raw(a), array_##type##_raw(b), common * sizeof(type));	\
+		if(result == 0 && a->elements_used != b->elements_used)					\
+			result = a->elements_used < b->elements_used ? -1 : 1;				\
+		return result < 0 ? -1 : result > 0;									\
+	}																			\
+																				\
+	static BOOL array_##type##_fill(array_##type var, type value) {				\
+		if(var->elements_used == 0)												\
+			return TRUE;														\
+		if(!array_##type##_unshare(var))										\
+			return FALSE;														\
+		array_fill_elements(array_##type##_raw(var), var->elements_used, &value, sizeof(type));	\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_copy_from(array_##type to, array_##type from) {	\
+		if(array_##type##_raw(to) == array_##type##_raw(from)) {				\
+			to->elements_used = from->elements_used;							\
+			return TRUE;														\
+		}																		\
+		if(!array_##type##_unshare(to) || !array_##type##_grow(to, from->elements_used))	\
+			return FALSE;														\
+		if(from->elements_used > 0)												\
+			memcpy(array_##type##_raw(to), array_##type##_raw(from), from->elements_used * sizeof(type));	\
+		to->elements_used = from->elements_used;								\
+		return TRUE;															\
+	}																			\
+																				\
+	/* dst views the elements of src from *pos up to the next separator or the */	\
+	/* end, as with slice, and *pos moves past the separator. FALSE once *pos */	\
+	/* is at the end, so a trailing separator ends nothing more. */				\
+	static BOOL array_##type##_split(array_##type dst, array_##type src, size_t *pos, type separator) {	\
+		if(*pos >= src->elements_used)											\
+			return FALSE;														\
+		size_t end = array_##type##_find(src, separator, *pos);					\
+		if(end == ARRAY_NPOS)													\
+			end = src->elements_used;											\
+		array_##type##_slice(dst, src, *pos, end - *pos);						\
+		*pos = end + 1;															\
+		return TRUE;															\
+	}																			\
+																				\
 	static type array_##type##_get(array_##type var, size_t pos) {				\
 		type value = {0};														\
 		if(pos < var->elements_used)											\
@@ -82,7 +537,7 @@
 	}																			\
 																				\
 	static BOOL array_##type##_set(array_##type var, size_t pos, type value) {	\
-		if(pos >= var->elements_used)											\
+		if(pos >= var->elements_used || !array_##type##_unshare(var))			\
 			return FALSE;														\
 		array_##type##_raw(var)[pos] = value;									\
 		return TRUE;															\
@@ -92,16 +547,20 @@
 
 
 
-#define TEMPLATE_ARRAY_OBJ(type) 												\
+#define TEMPLATE_ARRAY_OBJ_EX(type, policy) \
 	typedef struct internal_array_##type {										\
 		alloc_ptr ptr;															\
 		size_t elements_used;													\
 	} array_##type[1], *ret_array_##type;										\
 																				\
+	/* the node's layout: elements starting with their alloc_ptr, as every template's types do */	\
+	static const size_t array_##type##_ptr_offsets[1] = { 0 };					\
+	static const alloc_type array_##type##_layout = { sizeof(type), 1, array_##type##_ptr_offsets };	\
+																				\
 	static void array_##type##_init(array_##type var, size_t elements, size_t reserved) {	\
 		if(reserved < elements)													\
 			reserved = elements;												\
-		alloc_init(&var->ptr, reserved * sizeof(type));							\
+		alloc_init_typed(&var->ptr, &array_##type##_layout, reserved * sizeof(type));	\
 		if(var->ptr.node)														\
 			var->elements_used = elements;										\
 		else																	\
@@ -109,9 +568,8 @@
 	}																			\
 																				\
 	static ret_array_##type array_##type##_new(size_t elements) {				\
-		ret_array_##type ret = alloc_return_new(elements * sizeof(type));		\
-		if(ret)																	\
-			ret->elements_used = elements;										\
+		ret_array_##type ret = alloc_return_new_typed(&array_##type##_layout, elements * sizeof(type));	\
+		ret->elements_used = ret->ptr.node ? elements : 0;						\
 		return ret;																\
 	}																			\
 																				\
@@ -143,18 +601,124 @@
 		return var->elements_used;												\
 	}																			\
 																				\
-	static BOOL array_##type##_add(array_##type var, type element) {			\
+	static size_t array_##type##_capacity(array_##type var) {					\
+		return alloc_size(&var->ptr) / sizeof(type);							\
+	}																			\
+																				\
+	/* Unused capacity is kept zeroed, so it never holds stray alloc_ptrs.		\
+	   alloc_resize does that for typed nodes, the others come from snapshots. */	\
+	static BOOL array_##type##_realloc(array_##type var, size_t elements) {		\
+		if(!var->ptr.node && elements == 0)										\
+			return TRUE;														\
+		size_t old_size = alloc_size(&var->ptr);								\
+		struct alloc_node *new_node = var->ptr.node ?							\
+			alloc_resize(var->ptr.node, elements * sizeof(type)) :				\
+			alloc_new_typed(&array_##type##_layout, elements * sizeof(type));	\
+		if(elements > 0 && !new_node)											\
+			return FALSE;														\
+		alloc_set_node(&var->ptr, new_node);									\
+		if(elements * sizeof(type) > old_size && !alloc_is_typed(&var->ptr))	\
+			memset((char*)alloc_data(&var->ptr) + old_size, 0, elements * sizeof(type) - old_size);	\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_grow(array_##type var, size_t elements) {		\
 		size_t size = alloc_size(&var->ptr);									\
-		if(var->elements_used * sizeof(type) == alloc_size(&var->ptr)) {		\
-			struct alloc_node *new_node = alloc_resize(var->ptr.node, (size + sizeof(type)) * 2);\
-			if(!new_node)														\
+		if(elements * sizeof(type) <= size)										\
+			return TRUE;														\
+		size_t capacity = policy(size, elements * sizeof(type), sizeof(type)) / sizeof(type);	\
+		return array_##type##_realloc(var, capacity < elements ? elements : capacity);	\
+	}																			\
+																				\
+	static BOOL array_##type##_reserve(array_##type var, size_t elements) {		\
+		if(elements <= array_##type##_capacity(var))							\
+			return TRUE;														\
+		return array_##type##_realloc(var, elements);							\
+	}																			\
+																				\
+	static BOOL array_##type##_shrink_to_fit(array_##type var) {				\
+		if(var->elements_used == array_##type##_capacity(var))					\
+			return TRUE;														\
+		return array_##type##_realloc(var, var->elements_used);					\
+	}																			\
+																				\
+	/* the index of the element p points to, ARRAY_NPOS if it is not */			\
+	/* one of var's, so that a copy from var itself finds its source */			\
+	/* again once var has grown */												\
+	static size_t array_##type##_index_of(array_##type var, ret_##type p) {		\
+		ret_##type data = array_##type##_raw(var);								\
+		return p >= data && p < data + var->elements_used ? (size_t)(p - data) : ARRAY_NPOS;	\
+	}																			\
+																				\
+	/* element may be one of var's */											\
+	static BOOL array_##type##_add(array_##type var, type element) {			\
+		size_t from = array_##type##_index_of(var, element);					\
+		if(!array_##type##_grow(var, var->elements_used + 1))					\
+			return FALSE;														\
+		if(from != ARRAY_NPOS)													\
+			element = array_##type##_raw(var) + from;							\
+		type##_assign(&array_##type##_raw(var)[var->elements_used++], element);	\
+		return TRUE;															\
+	}																			\
+																				\
+	/* elements may be var's own */												\
+	static BOOL array_##type##_append_n(array_##type var, ret_##type elements, size_t count) {	\
+		size_t from = array_##type##_index_of(var, elements);					\
+		if(!array_##type##_grow(var, var->elements_used + count))				\
+			return FALSE;														\
+		if(from != ARRAY_NPOS)													\
+			elements = array_##type##_raw(var) + from;							\
+		for(size_t i = 0; i < count; i++)										\
+			type##_assign(&array_##type##_raw(var)[var->elements_used++], &elements[i]);	\
+		return TRUE;															\
+	}																			\
+																				\
+	/* elements may be var's own */												\
+	static BOOL array_##type##_insert_range(array_##type var, size_t pos, ret_##type elements, size_t count) {	\
+		size_t from = array_##type##_index_of(var, elements);					\
+		if(pos > var->elements_used || !array_##type##_grow(var, var->elements_used + count))	\
+			return FALSE;														\
+		if(count > 0) {															\
+			alloc_move(&var->ptr, (pos + count) * sizeof(type), pos * sizeof(type), (var->elements_used - pos) * sizeof(type));	\
+			for(size_t i = 0; i < count; i++) {									\
+				/* those of var's own from pos on were just moved up by count */	\
+				size_t source = from == ARRAY_NPOS ? ARRAY_NPOS : from + i < pos ? from + i : from + i + count;	\
+				type##_assign(&array_##type##_raw(var)[pos + i], source == ARRAY_NPOS ? &elements[i] : &array_##type##_raw(var)[source]);	\
+			}																	\
+			var->elements_used += count;										\
+		}																		\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_erase_range(array_##type var, size_t pos, size_t count) {	\
+		if(pos > var->elements_used)											\
+			return FALSE;														\
+		if(count > var->elements_used - pos)									\
+			count = var->elements_used - pos;									\
+		if(count > 0) {															\
+			alloc_clear(&var->ptr, pos * sizeof(type), count * sizeof(type));	\
+			alloc_move(&var->ptr, pos * sizeof(type), (pos + count) * sizeof(type), (var->elements_used - pos - count) * sizeof(type));	\
+			var->elements_used -= count;										\
+		}																		\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL array_##type##_resize(array_##type var, size_t elements) {		\
+		if(elements > var->elements_used) {										\
+			if(!array_##type##_grow(var, elements))								\
 				return FALSE;													\
-			var->ptr.node = new_node;											\
+		} else {																\
+			alloc_clear(&var->ptr, elements * sizeof(type), (var->elements_used - elements) * sizeof(type));	\
 		}																		\
-		type##_assign(&array_##type##_raw(var)[var->elements_used++], element);	\
+		var->elements_used = elements;											\
 		return TRUE;															\
 	}																			\
 																				\
+	static void array_##type##_clear(array_##type var) {						\
+		alloc_clear(&var->ptr, 0, var->elements_used * sizeof(type));			\
+		var->elements_used = 0;													\
+	}																			\
+																				\
 	static ret_##type array_##type##_get(array_##type var, size_t pos) {		\
 		if(pos < var->elements_used)											\
 			return &array_##type##_raw(var)[pos];								\
@@ -201,10 +765,86 @@
 		return array_##type##_size(var);										\
 	}																			\
 																				\
+	static size_t alias##_capacity(alias var) {									\
+		return array_##type##_capacity(var);									\
+	}																			\
+																				\
+	static BOOL alias##_reserve(alias var, size_t elements) {					\
+		return array_##type##_reserve(var, elements);							\
+	}																			\
+																				\
+	static BOOL alias##_shrink_to_fit(alias var) {								\
+		return array_##type##_shrink_to_fit(var);								\
+	}																			\
+																				\
 	static BOOL alias##_add(alias var, type element) {							\
 		return array_##type##_add(var, element); 								\
 	}																			\
 																				\
+	static BOOL alias##_append_n(alias var, const type *elements, size_t count) {	\
+		return array_##type##_append_n(var, elements, count);					\
+	}																			\
+																				\
+	static BOOL alias##_insert_range(alias var, size_t pos, const type *elements, size_t count) {	\
+		return array_##type##_insert_range(var, pos, elements, count);			\
+	}																			\
+																				\
+	static BOOL alias##_erase_range(alias var, size_t pos, size_t count) {		\
+		return array_##type##_erase_range(var, pos, count);						\
+	}																			\
+																				\
+	static BOOL alias##_resize(alias var, size_t elements) {					\
+		return array_##type##_resize(var, elements);							\
+	}																			\
+																				\
+	static void alias##_clear(alias var) {										\
+		array_##type##_clear(var);												\
+	}																			\
+																				\
+	static size_t alias##_find(alias var, type value, size_t from) {			\
+		return array_##type##_find(var, value, from);							\
+	}																			\
+																				\
+	static size_t alias##_count(alias var, type value) {						\
+		return array_##type##_count(var, value);								\
+	}																			\
+																				\
+	static BOOL alias##_equal(alias a, alias b) {								\
+		return array_##type##_equal(a, b);										\
+	}																			\
+																				\
+	static int alias##_compare(alias a, alias b) {								\
+		return array_##type##_compare(a, b);									\
+	}																			\
+																				\
+	static BOOL alias##_fill(alias var, type value) {							\
+		return array_##type##_fill(var, value);									\
+	}																			\
+																				\
+	static BOOL alias##_slice(alias dst, alias src, size_t pos, size_t count) {	\
+		return array_##type##_slice(dst, src, pos, count);						\
+	}																			\
+																				\
+	static BOOL alias##_copy_from(alias to, alias from) {						\
+		return array_##type##_copy_from(to, from);								\
+	}																			\
+																				\
+	static BOOL alias##_split(alias dst, alias src, size_t *pos, type separator) {	\
+		return array_##type##_split(dst, src, pos, separator);					\
+	}																			\
+																				\
+	static BOOL alias##_read_file(alias var, const char *filename) {			\
+		return array_##type##_read_file(var, filename);							\
+	}																			\
+																				\
+	static BOOL alias##_intern(alias dst, alias src) {							\
+		return array_##type##_intern(dst, src);									\
+	}																			\
+																				\
+	static BOOL alias##_is_interned(alias var) {								\
+		return array_##type##_is_interned(var);									\
+	}																			\
+																				\
 	static type alias##_get(alias var, size_t pos) {							\
 		return array_##type##_get(var, pos); 									\
 	}																			\
@@ -214,4 +854,9 @@
 	}																			\
 																				\
 	typedef alias alias##typedef_expected_semicolon_after_macro
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
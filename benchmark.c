@@ -0,0 +1,1211 @@
+//
+// Microbenchmarks for alloc.c and the array templates.
+//
+//   make benchmark && ./benchmark [max_live_nodes [file_megabytes]]
+//
+// Every benchmark runs with 1K, 10K, ... live nodes (up to max_live_nodes,
+// 100K by default; pass 10000000 for the full range) registered in the
+// enclosing frame, since several operations walk the whole heap. The others
+// run on their own afterwards, one op each being:
+//
+//   growth_*          one array grown with each growth policy
+//   grow_large_*      an array of LARGE_ARRAY_BYTES built with nodes that big
+//                     resized with mremap, or copied
+//   find_*, count_*,  one pass over KERNEL_ELEMENTS elements
+//   equal_int_*, fill_*
+//   tokenize_*        a text of KERNEL_ELEMENTS chars split at spaces, into
+//                     slices or copies
+//   equal_lines_*     the two lines of one of EQUAL_LINES pairs compared,
+//                     copied or interned
+//   short_*string     a short array returned, plain or small
+//   *_lookup,         one operation on a table of HASHMAP_KEYS int keys;
+//   *_insert          linear_scan_lookup goes through arrays of keys and values
+//   obj_array_add     one array added to an array of arrays
+//   queue_*           one element pushed onto a queue of QUEUE_LENGTH and one
+//                     popped off, with a deque or an array erasing its first;
+//                     the *_obj ones queue arrays
+//   read_lines_*      every line of a file of file_megabytes (64 by default):
+//                     fgetc and array_T_add with a frame per line as in
+//                     example.c, or array_T_read_file and array_T_split,
+//                     keeping each line as a slice or a copy
+//   snapshot_*        the first SNAPSHOT_LINES lines of that file given back,
+//                     each in its own array_char: snapshot_load with
+//                     SNAPSHOT_LOAD, snapshot_rebuild* by reading a text file
+//                     of just them and copying or interning each line
+//   obj_array_gc      alloc_gc with OBJ_ARRAY_LENGTH arrays in an array
+//
+// Results are written to stdout as CSV:
+//
+//   benchmark,live_nodes,iterations,ns_per_op,allocs_per_op,peak_bytes
+//
+// peak_bytes is the highest alloc_memory_usage() seen during the run, above
+// the usage when it started. Benchmarks named malloc_* are baselines using
+// plain malloc/realloc, which peak_bytes does not cover, and *_get_loop and
+// *_set_loop do the same work one array_T_get or array_T_set at a time.
+//
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "array.h"
+#include "hashmap.h"
+#include "deque.h"
+
+#define MIN_SECONDS 0.05
+#define MAX_ITERATIONS ((size_t)1 << 26)
+#define ARRAY_RESET 1024	// elements added before an array is released and rebuilt
+#define GROWTH_RESET ((size_t)1 << 20)	// the same for the growth_* benchmarks
+#define LARGE_ARRAY_BYTES ((size_t)256 << 20)
+#define LARGE_ARRAY_CHUNK ((size_t)1 << 20)	// bytes added to it at a time
+#define KERNEL_ELEMENTS 65536
+#define HASHMAP_KEYS 1024
+#define QUEUE_LENGTH 1024
+#define OBJ_ARRAY_LENGTH 65536	// arrays in the array gone through by obj_array_gc
+#define EQUAL_LINES 128
+#define LINES_FILENAME "benchmark_lines.tmp"
+#define SNAPSHOT_LINES 10000
+#define SNAPSHOT_TEXT_FILENAME "benchmark_snapshot_text.tmp"
+#define SNAPSHOT_FILENAME "benchmark_snapshot.tmp"
+
+typedef int int_x1_5;
+typedef int int_size_class;
+typedef int int_near_limit;
+typedef char small_char;
+
+TEMPLATE_ARRAY(int);
+TEMPLATE_ARRAY(char);
+TEMPLATE_ARRAY_SMALL(small_char, 24);
+TEMPLATE_ARRAY_EX(int_x1_5, alloc_growth_x1_5);
+TEMPLATE_ARRAY_EX(int_size_class, alloc_growth_size_class);
+TEMPLATE_ARRAY_EX(int_near_limit, alloc_growth_near_limit);
+TEMPLATE_ARRAY_OBJ(array_char);
+TEMPLATE_HASHMAP(int, int);
+TEMPLATE_DEQUE(int);
+TEMPLATE_DEQUE_OBJ(array_char);
+
+
+typedef struct benchmark {
+	const char *name;
+	void (*run)(size_t iterations);
+} benchmark;
+
+// the baseline for the hashmap benchmarks
+typedef struct chained_entry {
+	struct chained_entry *next;
+	int key;
+	int value;
+} chained_entry;
+
+typedef struct chained_table {
+	chained_entry **buckets;
+	size_t bucket_count;	// a power of two
+	size_t count;
+} chained_table;
+
+
+static alloc_ptr *live;
+static size_t live_count;
+static alloc_ptr scratch;
+static size_t baseline_allocations;
+static volatile size_t sink;
+static array_int ints, other_ints;
+static array_char chars;
+static array_char text;
+static array_array_char strings;
+static array_array_char copied_lines, other_copied_lines;
+static array_array_char interned_lines, other_interned_lines;
+static hashmap_int_int map;
+static array_int map_keys, map_values;
+static chained_table chained;
+static size_t lines_file_bytes = (size_t)64 << 20;
+
+
+static void out_of_memory() {
+	puts("Ran out of memory.");
+	exit(1);
+}
+
+
+static double now_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static void bench_frame(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++) {
+		BEGIN
+		END
+	}
+}
+
+
+static ret_array_int make_array()
+BEGIN
+	ARRAY_INIT(int, array, 1, 1);
+	RETURN(array);
+END
+
+
+static void bench_alloc_return(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += array_int_size(make_array());
+}
+
+
+static void bench_alloc_assign(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		alloc_assign(&scratch, &live[i % live_count]);
+
+	alloc_assign(&scratch, NULL);
+}
+
+
+static void bench_alloc_resize(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++) {
+		alloc_ptr *ptr = &live[i % live_count];
+
+		if(!alloc_resize(ptr->node, alloc_size(ptr) == 16 ? 32 : 16))
+			out_of_memory();
+	}
+}
+
+
+static void bench_malloc_resize(size_t iterations) {
+	void *blocks[64] = { 0 };
+
+	for(size_t i = 0; i < iterations; i++) {
+		void **block = &blocks[i % 64];
+		*block = realloc(*block, (i / 64) % 2 ? 32 : 16);
+		baseline_allocations++;
+
+		if(!*block)
+			out_of_memory();
+	}
+
+	for(size_t i = 0; i < 64; i++)
+		free(blocks[i]);
+}
+
+
+static void bench_alloc_gc(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		alloc_gc();
+}
+
+
+static void bench_array_add(size_t iterations)
+BEGIN
+	ARRAY_INIT(int, array, 0, 0);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(array_int_size(array) == ARRAY_RESET)
+			array_int_assign(array, NULL);
+
+		if(!array_int_add(array, (int)i))
+			out_of_memory();
+	}
+
+	sink += array_int_size(array);
+	RETURN_VOID;
+END
+
+
+static void bench_malloc_add(size_t iterations) {
+	int *array = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(size == ARRAY_RESET) {
+			free(array);
+			array = NULL;
+			size = capacity = 0;
+		}
+
+		if(size == capacity) {
+			capacity = (capacity + 1) * 2;
+			array = realloc(array, capacity * sizeof(int));
+			baseline_allocations++;
+
+			if(!array)
+				out_of_memory();
+		}
+
+		array[size++] = (int)i;
+	}
+
+	sink += size;
+	free(array);
+}
+
+
+#define BENCH_GROWTH(type)													\
+	static void bench_growth_##type(size_t iterations)						\
+	BEGIN																	\
+		ARRAY_INIT(type, array, 0, 0);										\
+																			\
+		for(size_t i = 0; i < iterations; i++) {							\
+			if(array_##type##_size(array) == GROWTH_RESET)					\
+				array_##type##_assign(array, NULL);							\
+																			\
+			if(!array_##type##_add(array, (int)i))							\
+				out_of_memory();											\
+		}																	\
+																			\
+		sink += array_##type##_size(array);									\
+		RETURN_VOID;														\
+	END
+
+BENCH_GROWTH(int)
+BENCH_GROWTH(int_x1_5)
+BENCH_GROWTH(int_size_class)
+
+
+// the same, with the limit set so that doubling would not fit
+static void bench_growth_int_near_limit(size_t iterations) {
+	size_t max_bytes = alloc_max_memory_usage();
+
+	alloc_set_max_memory_usage(alloc_memory_usage() + GROWTH_RESET * sizeof(int) * 5 / 2);
+
+	BEGIN
+	ARRAY_INIT(int_near_limit, array, 0, 0);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(array_int_near_limit_size(array) == GROWTH_RESET)
+			array_int_near_limit_assign(array, NULL);
+
+		if(!array_int_near_limit_add(array, (int)i))
+			out_of_memory();
+	}
+
+	sink += array_int_near_limit_size(array);
+	END
+
+	alloc_set_max_memory_usage(max_bytes);
+}
+
+
+static void grow_large_array(size_t iterations)
+BEGIN
+	ARRAY_INIT(char, array, 0, 0);
+
+	for(size_t i = 0; i < iterations; i++) {
+		array_char_assign(array, NULL);
+
+		while(array_char_size(array) < LARGE_ARRAY_BYTES) {
+			if(!array_char_resize(array, array_char_size(array) + LARGE_ARRAY_CHUNK))
+				out_of_memory();
+		}
+	}
+
+	sink += array_char_size(array);
+	RETURN_VOID;
+END
+
+
+static void bench_grow_large_mremap(size_t iterations) {
+	grow_large_array(iterations);
+}
+
+
+static void bench_grow_large_copy(size_t iterations) {
+	size_t threshold = alloc_mmap_threshold();
+
+	alloc_set_mmap_threshold(SIZE_MAX);
+	grow_large_array(iterations);
+	alloc_set_mmap_threshold(threshold);
+}
+
+
+static void bench_find_int(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += array_int_find(ints, -1, 0);
+}
+
+
+static void bench_find_int_get_loop(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++) {
+		size_t size = array_int_size(ints);
+		size_t pos = 0;
+
+		while(pos < size && array_int_get(ints, pos) != -1)
+			pos++;
+
+		sink += pos;
+	}
+}
+
+
+static void bench_find_char(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += array_char_find(chars, '\n', 0);
+}
+
+
+static void bench_find_char_get_loop(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++) {
+		size_t size = array_char_size(chars);
+		size_t pos = 0;
+
+		while(pos < size && array_char_get(chars, pos) != '\n')
+			pos++;
+
+		sink += pos;
+	}
+}
+
+
+static void bench_count_int(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += array_int_count(ints, 7);
+}
+
+
+static void bench_count_int_get_loop(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++) {
+		size_t size = array_int_size(ints);
+
+		for(size_t pos = 0; pos < size; pos++)
+			sink += array_int_get(ints, pos) == 7;
+	}
+}
+
+
+static void bench_equal_int(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += array_int_equal(ints, other_ints);
+}
+
+
+static void bench_equal_int_get_loop(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++) {
+		size_t size = array_int_size(ints);
+		size_t pos = 0;
+
+		while(pos < size && array_int_get(ints, pos) == array_int_get(other_ints, pos))
+			pos++;
+
+		sink += pos;
+	}
+}
+
+
+// one array_char_equal per op between the lines of a pair
+static void equal_lines(size_t iterations, array_array_char lines, array_array_char other_lines) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += array_char_equal(array_array_char_raw(lines) + i % EQUAL_LINES, array_array_char_raw(other_lines) + i % EQUAL_LINES);
+}
+
+
+static void bench_equal_lines_copy(size_t iterations) {
+	equal_lines(iterations, copied_lines, other_copied_lines);
+}
+
+
+static void bench_equal_lines_interned(size_t iterations) {
+	equal_lines(iterations, interned_lines, other_interned_lines);
+}
+
+
+static void bench_fill_int(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		array_int_fill(other_ints, (int)i);
+}
+
+
+static void bench_fill_int_set_loop(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++) {
+		size_t size = array_int_size(other_ints);
+
+		for(size_t pos = 0; pos < size; pos++)
+			array_int_set(other_ints, pos, (int)i);
+	}
+}
+
+
+// splits text at spaces, keeping each word in turn
+static void bench_tokenize_slice(size_t iterations)
+BEGIN
+	ARRAY_INIT_NULL(char, word);
+
+	for(size_t i = 0; i < iterations; i++) {
+		size_t pos = 0;
+		size_t end;
+
+		while((end = array_char_find(text, ' ', pos)) != ARRAY_NPOS) {
+			array_char_slice(word, text, pos, end - pos);
+			sink += array_char_size(word);
+			pos = end + 1;
+		}
+	}
+
+	RETURN_VOID;
+END
+
+
+static void bench_tokenize_copy(size_t iterations)
+BEGIN
+	ARRAY_INIT_NULL(char, word);
+
+	for(size_t i = 0; i < iterations; i++) {
+		size_t pos = 0;
+		size_t end;
+
+		while((end = array_char_find(text, ' ', pos)) != ARRAY_NPOS) {
+			array_char_assign(word, NULL);
+
+			if(!array_char_append_n(word, array_char_raw(text) + pos, end - pos))
+				out_of_memory();
+
+			sink += array_char_size(word);
+			pos = end + 1;
+		}
+	}
+
+	RETURN_VOID;
+END
+
+
+#define SHORT_STRING "a short line"
+
+static ret_array_char make_short_string()
+BEGIN
+	ARRAY_INIT(char, str, 0, 0);
+
+	if(!array_char_append_n(str, SHORT_STRING, sizeof SHORT_STRING))
+		out_of_memory();
+
+	RETURN(str);
+END
+
+
+static ret_array_small_char make_short_small_string()
+BEGIN
+	ARRAY_INIT(small_char, str, 0, 0);
+
+	if(!array_small_char_append_n(str, SHORT_STRING, sizeof SHORT_STRING))
+		out_of_memory();
+
+	RETURN(str);
+END
+
+
+static void bench_short_string(size_t iterations)
+BEGIN
+	ARRAY_INIT_NULL(char, str);
+
+	for(size_t i = 0; i < iterations; i++) {
+		array_char_assign(str, make_short_string());
+		sink += array_char_size(str);
+	}
+
+	RETURN_VOID;
+END
+
+
+static void bench_short_small_string(size_t iterations)
+BEGIN
+	ARRAY_INIT_NULL(small_char, str);
+
+	for(size_t i = 0; i < iterations; i++) {
+		array_small_char_assign(str, make_short_small_string());
+		sink += array_small_char_size(str);
+	}
+
+	RETURN_VOID;
+END
+
+
+// spread out, so that neither table gets sequential keys
+static int table_key(size_t i) {
+	return (int)((i % HASHMAP_KEYS) * 2654435761u);
+}
+
+
+// visits every key once per HASHMAP_KEYS lookups, in a scattered order
+static int lookup_key(size_t i) {
+	return table_key(i * 7919);
+}
+
+
+static void chained_free(chained_table *table) {
+	for(size_t i = 0; i < table->bucket_count; i++) {
+		while(table->buckets[i]) {
+			chained_entry *next = table->buckets[i]->next;
+			free(table->buckets[i]);
+			table->buckets[i] = next;
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = NULL;
+	table->bucket_count = 0;
+	table->count = 0;
+}
+
+
+static chained_entry *chained_find(chained_table *table, int key) {
+	if(!table->buckets)
+		return NULL;
+
+	chained_entry *entry = table->buckets[hashmap_hash(&key, sizeof key) & (table->bucket_count - 1)];
+
+	while(entry && entry->key != key)
+		entry = entry->next;
+
+	return entry;
+}
+
+
+static void chained_put(chained_table *table, int key, int value) {
+	chained_entry *entry = chained_find(table, key);
+
+	if(entry) {
+		entry->value = value;
+		return;
+	}
+
+	if(table->count >= table->bucket_count) {
+		size_t bucket_count = table->bucket_count ? table->bucket_count * 2 : 16;
+		chained_entry **buckets = calloc(bucket_count, sizeof(chained_entry*));
+
+		if(!buckets)
+			out_of_memory();
+
+		for(size_t i = 0; i < table->bucket_count; i++) {
+			while(table->buckets[i]) {
+				chained_entry *next = table->buckets[i]->next;
+				size_t bucket = hashmap_hash(&table->buckets[i]->key, sizeof(int)) & (bucket_count - 1);
+				table->buckets[i]->next = buckets[bucket];
+				buckets[bucket] = table->buckets[i];
+				table->buckets[i] = next;
+			}
+		}
+
+		free(table->buckets);
+		table->buckets = buckets;
+		table->bucket_count = bucket_count;
+	}
+
+	entry = malloc(sizeof(chained_entry));
+
+	if(!entry)
+		out_of_memory();
+
+	size_t bucket = hashmap_hash(&key, sizeof key) & (table->bucket_count - 1);
+	entry->key = key;
+	entry->value = value;
+	entry->next = table->buckets[bucket];
+	table->buckets[bucket] = entry;
+	table->count++;
+}
+
+
+static void bench_hashmap_lookup(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += hashmap_int_int_get(map, lookup_key(i));
+}
+
+
+static void bench_linear_scan_lookup(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += array_int_get(map_values, array_int_find(map_keys, lookup_key(i), 0));
+}
+
+
+static void bench_malloc_chained_lookup(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += chained_find(&chained, lookup_key(i))->value;
+}
+
+
+static void bench_hashmap_insert(size_t iterations)
+BEGIN
+	HASHMAP_INIT(int, int, table, 0);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(i % HASHMAP_KEYS == 0)
+			hashmap_int_int_assign(table, NULL);
+
+		if(!hashmap_int_int_put(table, table_key(i), (int)i))
+			out_of_memory();
+	}
+
+	RETURN_VOID;
+END
+
+
+static void bench_malloc_chained_insert(size_t iterations) {
+	chained_table table = { 0 };
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(i % HASHMAP_KEYS == 0)
+			chained_free(&table);
+
+		chained_put(&table, table_key(i), (int)i);
+	}
+
+	chained_free(&table);
+}
+
+
+static void bench_queue_deque(size_t iterations)
+BEGIN
+	DEQUE_INIT(int, queue, QUEUE_LENGTH);
+
+	for(size_t i = 0; i < QUEUE_LENGTH; i++)
+		deque_int_push_back(queue, (int)i);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(!deque_int_push_back(queue, (int)i))
+			out_of_memory();
+
+		sink += deque_int_pop_front(queue);
+	}
+
+	RETURN_VOID;
+END
+
+
+static void bench_queue_array(size_t iterations)
+BEGIN
+	ARRAY_INIT(int, queue, 0, QUEUE_LENGTH + 1);
+
+	for(size_t i = 0; i < QUEUE_LENGTH; i++)
+		array_int_add(queue, (int)i);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(!array_int_add(queue, (int)i))
+			out_of_memory();
+
+		sink += array_int_get(queue, 0);
+		array_int_erase_range(queue, 0, 1);
+	}
+
+	RETURN_VOID;
+END
+
+
+// one array_T_add per op to an array of arrays, all sharing chars
+static void bench_obj_array_add(size_t iterations)
+BEGIN
+	ARRAY_INIT(array_char, array, 0, 0);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(array_array_char_size(array) == ARRAY_RESET)
+			array_array_char_assign(array, NULL);
+
+		if(!array_array_char_add(array, chars))
+			out_of_memory();
+	}
+
+	sink += array_array_char_size(array);
+	RETURN_VOID;
+END
+
+
+// strings, made on the first run, holds OBJ_ARRAY_LENGTH arrays of their own
+static void bench_obj_array_gc(size_t iterations)
+BEGIN
+	ARRAY_INIT(array_char, strings_local, 0, OBJ_ARRAY_LENGTH);
+	ARRAY_INIT_NULL(char, string);
+
+	if(!array_array_char_raw(strings))
+		array_array_char_global_assign(strings, strings_local);
+
+	for(size_t i = array_array_char_size(strings); i < OBJ_ARRAY_LENGTH; i++) {
+		array_char_assign(string, NULL);
+
+		if(!array_char_add(string, 'a' + i % 26) || !array_array_char_add(strings, string))
+			out_of_memory();
+	}
+
+	array_char_assign(string, NULL);
+
+	for(size_t i = 0; i < iterations; i++)
+		alloc_gc();
+
+	RETURN_VOID;
+END
+
+
+// queues of arrays, all sharing chars
+static void bench_queue_deque_obj(size_t iterations)
+BEGIN
+	DEQUE_INIT(array_char, queue, QUEUE_LENGTH);
+
+	for(size_t i = 0; i < QUEUE_LENGTH; i++)
+		deque_array_char_push_back(queue, chars);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(!deque_array_char_push_back(queue, chars))
+			out_of_memory();
+
+		deque_array_char_pop_front(queue, NULL);
+	}
+
+	RETURN_VOID;
+END
+
+
+static void bench_queue_array_obj(size_t iterations)
+BEGIN
+	ARRAY_INIT(array_char, queue, 0, QUEUE_LENGTH + 1);
+
+	for(size_t i = 0; i < QUEUE_LENGTH; i++)
+		array_array_char_add(queue, chars);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(!array_array_char_add(queue, chars))
+			out_of_memory();
+
+		array_array_char_erase_range(queue, 0, 1);
+	}
+
+	RETURN_VOID;
+END
+
+
+static ret_array_small_char read_line(FILE *file, BOOL *eof)
+BEGIN
+	int ch;
+	ARRAY_INIT(small_char, line, 0, 0);
+
+	while((ch = fgetc(file)) != EOF && ch != '\n') {
+		if(!array_small_char_add(line, (char)ch))
+			out_of_memory();
+	}
+
+	*eof = (ch == EOF);
+	RETURN(line);
+END
+
+
+static void bench_read_lines_fgetc(size_t iterations)
+BEGIN
+	ARRAY_INIT_NULL(small_char, line);
+
+	for(size_t i = 0; i < iterations; i++) {
+		BOOL eof = FALSE;
+		FILE *file = fopen(LINES_FILENAME, "rb");
+
+		if(!file)
+			out_of_memory();
+
+		while(!eof) {
+			array_small_char_assign(line, read_line(file, &eof));
+			sink += array_small_char_size(line);
+		}
+
+		fclose(file);
+	}
+
+	RETURN_VOID;
+END
+
+
+static void bench_read_lines_slice(size_t iterations)
+BEGIN
+	ARRAY_INIT_NULL(char, file_text);
+	ARRAY_INIT_NULL(char, line);
+
+	for(size_t i = 0; i < iterations; i++) {
+		size_t pos = 0;
+
+		if(!array_char_read_file(file_text, LINES_FILENAME))
+			out_of_memory();
+
+		while(array_char_split(line, file_text, &pos, '\n'))
+			sink += array_char_size(line);
+	}
+
+	RETURN_VOID;
+END
+
+
+static void bench_read_lines_copy(size_t iterations)
+BEGIN
+	ARRAY_INIT_NULL(char, file_text);
+	ARRAY_INIT_NULL(small_char, line);
+
+	for(size_t i = 0; i < iterations; i++) {
+		size_t pos = 0;
+		size_t end;
+
+		if(!array_char_read_file(file_text, LINES_FILENAME))
+			out_of_memory();
+
+		const char *raw = array_char_raw(file_text);
+		size_t size = array_char_size(file_text);
+
+		for(; pos < size; pos = end + 1) {
+			if((end = array_char_find(file_text, '\n', pos)) == ARRAY_NPOS)
+				end = size;
+
+			array_small_char_clear(line);
+
+			if(!array_small_char_append_n(line, raw + pos, end - pos))
+				out_of_memory();
+
+			sink += array_small_char_size(line);
+		}
+	}
+
+	RETURN_VOID;
+END
+
+
+// the lines of SNAPSHOT_TEXT_FILENAME, each copied into an array_char or
+// interned
+static ret_array_array_char read_snapshot_lines(BOOL intern)
+BEGIN
+	ARRAY_INIT_NULL(char, file_text);
+	ARRAY_INIT_NULL(char, line);
+	ARRAY_INIT(array_char, lines, 0, SNAPSHOT_LINES);
+	size_t pos = 0;
+	size_t end;
+
+	if(!array_char_read_file(file_text, SNAPSHOT_TEXT_FILENAME))
+		out_of_memory();
+
+	const char *raw = array_char_raw(file_text);
+	size_t size = array_char_size(file_text);
+
+	for(; pos < size; pos = end + 1) {
+		if((end = array_char_find(file_text, '\n', pos)) == ARRAY_NPOS)
+			end = size;
+
+		array_char_assign(line, NULL);
+
+		if(intern)
+			array_char_slice(line, file_text, pos, end - pos);
+
+		if(!(intern ? array_char_intern(line, line) : array_char_append_n(line, raw + pos, end - pos))
+			|| !array_array_char_add(lines, line))
+			out_of_memory();
+	}
+
+	RETURN(lines);
+END
+
+
+static void bench_snapshot_load(size_t iterations)
+BEGIN
+	ARRAY_INIT_NULL(array_char, lines);
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(!SNAPSHOT_LOAD(lines, SNAPSHOT_FILENAME))
+			out_of_memory();
+
+		sink += array_array_char_size(lines);
+	}
+
+	RETURN_VOID;
+END
+
+
+static void snapshot_rebuild(size_t iterations, BOOL intern)
+BEGIN
+	ARRAY_INIT_NULL(array_char, lines);
+
+	for(size_t i = 0; i < iterations; i++) {
+		array_array_char_assign(lines, read_snapshot_lines(intern));
+		sink += array_array_char_size(lines);
+	}
+
+	RETURN_VOID;
+END
+
+
+static void bench_snapshot_rebuild(size_t iterations) {
+	snapshot_rebuild(iterations, FALSE);
+}
+
+
+static void bench_snapshot_rebuild_intern(size_t iterations) {
+	snapshot_rebuild(iterations, TRUE);
+}
+
+
+static const benchmark benchmarks[] = {
+	{ "frame_begin_end", bench_frame },
+	{ "alloc_return", bench_alloc_return },
+	{ "alloc_assign", bench_alloc_assign },
+	{ "alloc_resize", bench_alloc_resize },
+	{ "malloc_resize", bench_malloc_resize },
+	{ "alloc_gc", bench_alloc_gc },
+	{ "array_add", bench_array_add },
+	{ "malloc_add", bench_malloc_add },
+};
+
+static const benchmark standalone_benchmarks[] = {
+	{ "growth_x2", bench_growth_int },
+	{ "growth_x1_5", bench_growth_int_x1_5 },
+	{ "growth_size_class", bench_growth_int_size_class },
+	{ "growth_near_limit", bench_growth_int_near_limit },
+	{ "grow_large_mremap", bench_grow_large_mremap },
+	{ "grow_large_copy", bench_grow_large_copy },
+	{ "find_int", bench_find_int },
+	{ "find_int_get_loop", bench_find_int_get_loop },
+	{ "find_char", bench_find_char },
+	{ "find_char_get_loop", bench_find_char_get_loop },
+	{ "count_int", bench_count_int },
+	{ "count_int_get_loop", bench_count_int_get_loop },
+	{ "equal_int", bench_equal_int },
+	{ "equal_int_get_loop", bench_equal_int_get_loop },
+	{ "equal_lines_copy", bench_equal_lines_copy },
+	{ "equal_lines_interned", bench_equal_lines_interned },
+	{ "fill_int", bench_fill_int },
+	{ "fill_int_set_loop", bench_fill_int_set_loop },
+	{ "tokenize_slice", bench_tokenize_slice },
+	{ "tokenize_copy", bench_tokenize_copy },
+	{ "short_string", bench_short_string },
+	{ "short_small_string", bench_short_small_string },
+	{ "hashmap_lookup", bench_hashmap_lookup },
+	{ "linear_scan_lookup", bench_linear_scan_lookup },
+	{ "malloc_chained_lookup", bench_malloc_chained_lookup },
+	{ "hashmap_insert", bench_hashmap_insert },
+	{ "malloc_chained_insert", bench_malloc_chained_insert },
+	{ "obj_array_add", bench_obj_array_add },
+	{ "queue_deque", bench_queue_deque },
+	{ "queue_array", bench_queue_array },
+	{ "queue_deque_obj", bench_queue_deque_obj },
+	{ "queue_array_obj", bench_queue_array_obj },
+	{ "read_lines_fgetc", bench_read_lines_fgetc },
+	{ "read_lines_slice", bench_read_lines_slice },
+	{ "read_lines_copy", bench_read_lines_copy },
+	{ "snapshot_load", bench_snapshot_load },
+	{ "snapshot_rebuild", bench_snapshot_rebuild },
+	{ "snapshot_rebuild_intern", bench_snapshot_rebuild_intern },
+	{ "obj_array_gc", bench_obj_array_gc },	// last, as strings slows down what walks the heap
+};
+
+
+static void run_benchmark(const benchmark *bench) {
+	size_t iterations = 1;
+	double elapsed;
+	size_t allocations;
+	size_t peak;
+
+	bench->run(1);
+
+	for(;;) {
+		size_t usage = alloc_memory_usage();
+		alloc_reset_peak_memory_usage();
+		allocations = alloc_allocation_count() + baseline_allocations;
+		double start = now_seconds();
+		bench->run(iterations);
+		elapsed = now_seconds() - start;
+		allocations = alloc_allocation_count() + baseline_allocations - allocations;
+		peak = alloc_peak_memory_usage() - usage;
+
+		if(elapsed >= MIN_SECONDS || iterations >= MAX_ITERATIONS)
+			break;
+
+		iterations *= elapsed > 0 && MIN_SECONDS / elapsed < 8 ? 2 : 8;
+	}
+
+	printf("%s,%lu,%lu,%.1f,%.3f,%lu\n", bench->name, (unsigned long)live_count, (unsigned long)iterations,
+		elapsed * 1e9 / iterations, (double)allocations / iterations, (unsigned long)peak);
+	fflush(stdout);
+}
+
+
+static void run_with_live_nodes(size_t count)
+BEGIN
+	live = calloc(count, sizeof(alloc_ptr));
+	live_count = count;
+
+	if(!live)
+		out_of_memory();
+
+	fprintf(stderr, "populating %lu live nodes\n", (unsigned long)count);
+
+	alloc_assign(&scratch, NULL);
+
+	for(size_t i = 0; i < count; i++) {
+		alloc_init(&live[i], 16);
+
+		if(!live[i].node)
+			out_of_memory();
+	}
+
+	for(size_t i = 0; i < sizeof benchmarks / sizeof benchmarks[0]; i++)
+		run_benchmark(&benchmarks[i]);
+
+	RETURN_VOID;
+END
+
+
+// arrays for the kernel and tokenize benchmarks; ints and chars do not contain
+// the values searched for
+static void make_kernel_arrays()
+BEGIN
+	ARRAY_INIT(int, ints_local, KERNEL_ELEMENTS, 0);
+	ARRAY_INIT(int, other_ints_local, 0, 0);
+	ARRAY_INIT(char, chars_local, KERNEL_ELEMENTS, 0);
+	ARRAY_INIT(char, text_local, KERNEL_ELEMENTS, 0);
+
+	if(!array_int_raw(ints_local) || !array_char_raw(chars_local))
+		out_of_memory();
+
+	for(size_t i = 0; i < KERNEL_ELEMENTS; i++) {
+		array_int_set(ints_local, i, (int)(i % 1000) + 1);
+		array_char_set(chars_local, i, 'a' + i % 26);
+		array_char_set(text_local, i, i % 7 == 6 ? ' ' : 'a' + i % 26);
+	}
+
+	if(!array_int_copy_from(other_ints_local, ints_local))
+		out_of_memory();
+
+	array_int_global_assign(ints, ints_local);
+	array_int_global_assign(other_ints, other_ints_local);
+	array_char_global_assign(chars, chars_local);
+	array_char_global_assign(text, text_local);
+	RETURN_VOID;
+END
+
+
+// EQUAL_LINES pairs of lines of 1 to EQUAL_LINES characters from chars, every
+// other pair differing in the last one, copied and interned
+static void make_equal_lines()
+BEGIN
+	ARRAY_INIT(array_char, copied, 0, EQUAL_LINES);
+	ARRAY_INIT(array_char, other_copied, 0, EQUAL_LINES);
+	ARRAY_INIT(array_char, interned, 0, EQUAL_LINES);
+	ARRAY_INIT(array_char, other_interned, 0, EQUAL_LINES);
+	ARRAY_INIT_NULL(char, line);
+	ARRAY_INIT_NULL(char, other_line);
+
+	for(size_t i = 0; i < EQUAL_LINES; i++) {
+		array_char_assign(line, NULL);
+		array_char_assign(other_line, NULL);
+
+		if(!array_char_append_n(line, array_char_raw(chars), i + 1)
+			|| !array_char_append_n(other_line, array_char_raw(chars), i + 1)
+			|| (i % 2 == 1 && !array_char_set(other_line, i, '-'))
+			|| !array_array_char_add(copied, line) || !array_array_char_add(other_copied, other_line)
+			|| !array_char_intern(line, line) || !array_char_intern(other_line, other_line)
+			|| !array_array_char_add(interned, line) || !array_array_char_add(other_interned, other_line))
+			out_of_memory();
+	}
+
+	array_array_char_global_assign(copied_lines, copied);
+	array_array_char_global_assign(other_copied_lines, other_copied);
+	array_array_char_global_assign(interned_lines, interned);
+	array_array_char_global_assign(other_interned_lines, other_interned);
+	RETURN_VOID;
+END
+
+
+// the same HASHMAP_KEYS keys and values in a hashmap, a pair of arrays and
+// a chained table
+static void make_lookup_tables()
+BEGIN
+	HASHMAP_INIT(int, int, map_local, HASHMAP_KEYS);
+	ARRAY_INIT(int, keys_local, 0, HASHMAP_KEYS);
+	ARRAY_INIT(int, values_local, 0, HASHMAP_KEYS);
+
+	for(size_t i = 0; i < HASHMAP_KEYS; i++) {
+		if(!hashmap_int_int_put(map_local, table_key(i), (int)i) || !array_int_add(keys_local, table_key(i))
+				|| !array_int_add(values_local, (int)i))
+			out_of_memory();
+
+		chained_put(&chained, table_key(i), (int)i);
+	}
+
+	hashmap_int_int_global_assign(map, map_local);
+	array_int_global_assign(map_keys, keys_local);
+	array_int_global_assign(map_values, values_local);
+	RETURN_VOID;
+END
+
+
+// LINES_FILENAME with lines of 0 to 99 characters, up to lines_file_bytes
+static void make_lines_file() {
+	FILE *file = fopen(LINES_FILENAME, "wb");
+	uint32_t state = 1;
+
+	if(!file)
+		out_of_memory();
+
+	for(size_t written = 0; written < lines_file_bytes;) {
+		state = state * 1664525 + 1013904223;
+		size_t length = (state >> 16) % 100;
+
+		for(size_t i = 0; i < length; i++)
+			fputc('a' + i % 26, file);
+
+		fputc('\n', file);
+		written += length + 1;
+	}
+
+	fclose(file);
+}
+
+
+// SNAPSHOT_TEXT_FILENAME with the first SNAPSHOT_LINES lines of
+// LINES_FILENAME, and SNAPSHOT_FILENAME with a snapshot of them
+static void make_snapshot()
+BEGIN
+	FILE *from = fopen(LINES_FILENAME, "rb");
+	FILE *to = fopen(SNAPSHOT_TEXT_FILENAME, "wb");
+	int c;
+
+	if(!from || !to)
+		out_of_memory();
+
+	for(size_t lines = 0; lines < SNAPSHOT_LINES && (c = fgetc(from)) != EOF;) {
+		fputc(c, to);
+		lines += c == '\n';
+	}
+
+	fclose(from);
+	fclose(to);
+
+	ARRAY_INIT_NULL(array_char, lines);
+	array_array_char_assign(lines, read_snapshot_lines(FALSE));
+
+	if(!SNAPSHOT_SAVE(lines, SNAPSHOT_FILENAME))
+		out_of_memory();
+
+	RETURN_VOID;
+END
+
+
+int main(int argc, char **argv) {
+	size_t max_live_nodes = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+
+	if(argc > 2)
+		lines_file_bytes = strtoul(argv[2], NULL, 10) << 20;
+
+	puts("benchmark,live_nodes,iterations,ns_per_op,allocs_per_op,peak_bytes");
+
+	BEGIN
+	for(size_t count = 1000; count <= max_live_nodes; count *= 10) {
+		run_with_live_nodes(count);
+		free(live);
+	}
+
+	live_count = 0;
+	make_kernel_arrays();
+	make_equal_lines();
+	make_lookup_tables();
+	make_lines_file();
+	make_snapshot();
+
+	for(size_t i = 0; i < sizeof standalone_benchmarks / sizeof standalone_benchmarks[0]; i++)
+		run_benchmark(&standalone_benchmarks[i]);
+	END
+
+	remove(LINES_FILENAME);
+	remove(SNAPSHOT_TEXT_FILENAME);
+	remove(SNAPSHOT_FILENAME);
+
+	return 0;
+}
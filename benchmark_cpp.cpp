@@ -0,0 +1,315 @@
+//
+// Microbenchmarks for alloc.hpp, named after the benchmarks in benchmark.c
+// that do the same work with the C macros, so the two can be compared row by
+// row.
+//
+//   make benchmark_cpp && ./benchmark_cpp [max_live_nodes]
+//
+// The first benchmarks run with 1K, 10K, ... live handles (up to
+// max_live_nodes, 100K by default), as benchmark.c runs them with live nodes
+// in a frame; handle_move moves a handle back and forth per op, which has no
+// counterpart there. The others run on their own afterwards: the kernel ones go
+// through KERNEL_ELEMENTS elements per op, with the *_std ones doing the same
+// with <algorithm>, short_string returns a short array per op and obj_array_add
+// adds one array to an array of arrays per op. Results are written to stdout
+// as the same CSV:
+//
+//   benchmark,live_nodes,iterations,ns_per_op,allocs_per_op,peak_bytes
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include "alloc.hpp"
+
+#define MIN_SECONDS 0.05
+#define MAX_ITERATIONS ((size_t)1 << 26)
+#define ARRAY_RESET 1024	// elements added before an array is released and rebuilt
+#define KERNEL_ELEMENTS 65536
+#define SHORT_STRING "a short line"
+
+
+struct benchmark {
+	const char *name;
+	void (*run)(size_t iterations);
+};
+
+
+static std::vector<alloc::array<char>> live;
+static alloc::array<char> scratch;
+static volatile size_t sink;
+static alloc::array<int> ints, other_ints;
+static alloc::array<char> chars;
+
+
+static double now_seconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static void bench_frame(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		alloc::scope scope(__FILE__, __LINE__);
+}
+
+
+static alloc::array<int> make_array() {
+	return alloc::array<int>(1);
+}
+
+
+static void bench_alloc_return(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += make_array().size();
+}
+
+
+static void bench_alloc_assign(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		scratch = live[i % live.size()];
+
+	scratch = alloc::array<char>();
+}
+
+
+static void bench_handle_move(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++) {
+		alloc::array<char> &from = live[i % live.size()];
+
+		scratch = std::move(from);
+		from = std::move(scratch);
+	}
+}
+
+
+static void bench_alloc_gc(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		alloc_gc();
+}
+
+
+static void bench_array_add(size_t iterations) {
+	alloc::scope scope(__FILE__, __LINE__);
+	alloc::array<int> array;
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(array.size() == ARRAY_RESET)
+			array = alloc::array<int>();
+
+		array.push_back((int)i);
+	}
+
+	sink += array.size();
+}
+
+
+static void bench_find_int(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += ints.find(-1);
+}
+
+
+static void bench_find_int_std(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += std::find(ints.begin(), ints.end(), -1) - ints.begin();
+}
+
+
+static void bench_find_char(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += chars.find('-');
+}
+
+
+static void bench_find_char_std(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += std::find(chars.begin(), chars.end(), '-') - chars.begin();
+}
+
+
+static void bench_count_int(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += ints.count(1);
+}
+
+
+static void bench_count_int_std(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += std::count(ints.begin(), ints.end(), 1);
+}
+
+
+static void bench_equal_int(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		sink += ints == other_ints;
+}
+
+
+static void bench_fill_int(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		other_ints.fill((int)i);
+
+	std::copy(ints.begin(), ints.end(), other_ints.begin());
+}
+
+
+static void bench_fill_int_std(size_t iterations) {
+	for(size_t i = 0; i < iterations; i++)
+		std::fill(other_ints.begin(), other_ints.end(), (int)i);
+
+	std::copy(ints.begin(), ints.end(), other_ints.begin());
+}
+
+
+static alloc::array<char> make_short_string() {
+	alloc::array<char> str;
+
+	str.append(SHORT_STRING, sizeof SHORT_STRING);
+	return str;
+}
+
+
+static void bench_short_string(size_t iterations) {
+	alloc::scope scope(__FILE__, __LINE__);
+	alloc::array<char> str;
+
+	for(size_t i = 0; i < iterations; i++) {
+		str = make_short_string();
+		sink += str.size();
+	}
+}
+
+
+// one push_back per op to an array of arrays, all sharing chars
+static void bench_obj_array_add(size_t iterations) {
+	alloc::scope scope(__FILE__, __LINE__);
+	alloc::array<alloc::array<char>> array;
+
+	for(size_t i = 0; i < iterations; i++) {
+		if(array.size() == ARRAY_RESET)
+			array = alloc::array<alloc::array<char>>();
+
+		array.push_back(chars);
+	}
+
+	sink += array.size();
+}
+
+
+static const benchmark benchmarks[] = {
+	{ "frame_begin_end", bench_frame },
+	{ "alloc_return", bench_alloc_return },
+	{ "alloc_assign", bench_alloc_assign },
+	{ "handle_move", bench_handle_move },
+	{ "alloc_gc", bench_alloc_gc },
+	{ "array_add", bench_array_add },
+};
+
+static const benchmark standalone_benchmarks[] = {
+	{ "find_int", bench_find_int },
+	{ "find_int_std", bench_find_int_std },
+	{ "find_char", bench_find_char },
+	{ "find_char_std", bench_find_char_std },
+	{ "count_int", bench_count_int },
+	{ "count_int_std", bench_count_int_std },
+	{ "equal_int", bench_equal_int },
+	{ "fill_int", bench_fill_int },
+	{ "fill_int_std", bench_fill_int_std },
+	{ "short_string", bench_short_string },
+	{ "obj_array_add", bench_obj_array_add },
+};
+
+
+static void run_benchmark(const benchmark *bench) {
+	size_t iterations = 1;
+	double elapsed;
+	size_t allocations;
+	size_t peak;
+
+	bench->run(1);
+
+	for(;;) {
+		size_t usage = alloc_memory_usage();
+		alloc_reset_peak_memory_usage();
+		allocations = alloc_allocation_count();
+		double start = now_seconds();
+		bench->run(iterations);
+		elapsed = now_seconds() - start;
+		allocations = alloc_allocation_count() - allocations;
+		peak = alloc_peak_memory_usage() - usage;
+
+		if(elapsed >= MIN_SECONDS || iterations >= MAX_ITERATIONS)
+			break;
+
+		iterations *= elapsed > 0 && MIN_SECONDS / elapsed < 8 ? 2 : 8;
+	}
+
+	printf("%s,%lu,%lu,%.1f,%.3f,%lu\n", bench->name, (unsigned long)live.size(), (unsigned long)iterations,
+		elapsed * 1e9 / iterations, (double)allocations / iterations, (unsigned long)peak);
+	fflush(stdout);
+}
+
+
+static void run_with_live_nodes(size_t count) {
+	alloc::scope scope(__FILE__, __LINE__);
+
+	fprintf(stderr, "populating %lu live nodes\n", (unsigned long)count);
+
+	live.resize(count);
+
+	for(alloc::array<char> &array : live)
+		array = alloc::array<char>(16);
+
+	for(const benchmark &bench : benchmarks)
+		run_benchmark(&bench);
+
+	live.clear();
+}
+
+
+// arrays for the kernel benchmarks, which do not contain the values searched for
+static void make_kernel_arrays() {
+	ints = alloc::array<int>(KERNEL_ELEMENTS);
+	chars = alloc::array<char>(KERNEL_ELEMENTS);
+
+	for(size_t i = 0; i < KERNEL_ELEMENTS; i++) {
+		ints[i] = (int)(i % 1000) + 1;
+		chars[i] = 'a' + i % 26;
+	}
+
+	other_ints = alloc::array<int>(KERNEL_ELEMENTS);
+	std::copy(ints.begin(), ints.end(), other_ints.begin());
+}
+
+
+int main(int argc, char **argv) {
+	size_t max_live_nodes = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+
+	puts("benchmark,live_nodes,iterations,ns_per_op,allocs_per_op,peak_bytes");
+
+	try {
+		alloc::scope scope(__FILE__, __LINE__);
+
+		for(size_t count = 1000; count <= max_live_nodes; count *= 10)
+			run_with_live_nodes(count);
+
+		make_kernel_arrays();
+
+		for(const benchmark &bench : standalone_benchmarks)
+			run_benchmark(&bench);
+
+		// before alloc.c reports what is left at exit, which is before statics go
+		ints.reset();
+		other_ints.reset();
+		chars.reset();
+	} catch(const std::bad_alloc&) {
+		puts("Ran out of memory.");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,316 @@
+#ifndef CONTAINER_DEQUE_H
+#define CONTAINER_DEQUE_H
+
+//
+// Double-ended queues kept in a single node as a ring buffer: a header with
+// the position of the first element, the element count and the capacity, then
+// a power of two number of elements. Pushing and popping at either end is O(1). Growing
+// resizes the node and then moves the shorter of the ring's two runs past the
+// other, so the ring never needs unwrapping element by element.
+//
+// For TEMPLATE_DEQUE_OBJ the elements are managed types, stored and released
+// through type_assign like in TEMPLATE_ARRAY_OBJ. The free part of the ring
+// holds only released elements, whose alloc_ptrs stay tracked by the node.
+//
+// Assigning a deque shares its ring: changes show up through every copy.
+//
+
+#include <string.h>
+#include "alloc.h"
+
+#define DEQUE_MIN_CAPACITY 16
+
+#define DEQUE_INIT_NULL(type, name) \
+	deque_##type name = { 0 }
+
+#define DEQUE_INIT(type, name, reserved) \
+	deque_##type name = { 0 };													\
+	deque_##type##_init(name, reserved)
+
+
+typedef struct deque_header {
+	size_t head;	// ring position of the first element
+	size_t count;
+	size_t capacity;
+} deque_header;
+
+// the ring starts 16-byte aligned after the header
+#define DEQUE_RING_OFFSET ((sizeof(deque_header) + 15) & ~(size_t)15)
+
+
+#define TEMPLATE_DEQUE(type) \
+	INTERNAL_DEQUE_TYPE(type, type*);											\
+																				\
+	static void deque_##type##_move(deque_##type var, size_t to, size_t from, size_t count) {	\
+		memmove(deque_##type##_ring(var) + to, deque_##type##_ring(var) + from, count * sizeof(type));	\
+	}																			\
+																				\
+	static void deque_##type##_zero(deque_##type var, size_t from, size_t count) {	\
+		(void)var;																\
+		(void)from;																\
+		(void)count;															\
+	}																			\
+																				\
+	INTERNAL_DEQUE_FUNCTIONS(type, type*);										\
+																				\
+	static BOOL deque_##type##_push_back(deque_##type var, type element) {		\
+		type *slot = deque_##type##_add_back(var);								\
+		if(!slot)																\
+			return FALSE;														\
+		*slot = element;														\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL deque_##type##_push_front(deque_##type var, type element) {		\
+		type *slot = deque_##type##_add_front(var);								\
+		if(!slot)																\
+			return FALSE;														\
+		*slot = element;														\
+		return TRUE;															\
+	}																			\
+																				\
+	/* the removed element, or zero if the deque is empty */					\
+	static type deque_##type##_pop_back(deque_##type var) {						\
+		type element = {0};														\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(header && header->count > 0)											\
+			element = *deque_##type##_remove_back(header);						\
+		return element;															\
+	}																			\
+																				\
+	static type deque_##type##_pop_front(deque_##type var) {					\
+		type element = {0};														\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(header && header->count > 0)											\
+			element = *deque_##type##_remove_front(header);						\
+		return element;															\
+	}																			\
+																				\
+	static type deque_##type##_get(deque_##type var, size_t pos) {				\
+		type element = {0};														\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(header && pos < header->count)										\
+			element = *deque_##type##_at(header, pos);							\
+		return element;															\
+	}																			\
+																				\
+	static BOOL deque_##type##_set(deque_##type var, size_t pos, type element) {	\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(!header || pos >= header->count)										\
+			return FALSE;														\
+		*deque_##type##_at(header, pos) = element;								\
+		return TRUE;															\
+	}																			\
+																				\
+	static void deque_##type##_clear(deque_##type var) {						\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(header)																\
+			header->head = header->count = 0;									\
+	}																			\
+																				\
+	typedef type type##_deque_expected_semicolon_after_macro
+
+
+#define TEMPLATE_DEQUE_OBJ(type) \
+	INTERNAL_DEQUE_TYPE(type, ret_##type);										\
+																				\
+	static void deque_##type##_move(deque_##type var, size_t to, size_t from, size_t count) {	\
+		alloc_move(&var->ptr, DEQUE_RING_OFFSET + to * sizeof(type), DEQUE_RING_OFFSET + from * sizeof(type), count * sizeof(type));	\
+	}																			\
+																				\
+	/* new parts of the ring must not hold stray alloc_ptrs */					\
+	static void deque_##type##_zero(deque_##type var, size_t from, size_t count) {	\
+		memset(deque_##type##_ring(var) + from, 0, count * sizeof(type));		\
+	}																			\
+																				\
+	INTERNAL_DEQUE_FUNCTIONS(type, ret_##type);									\
+																				\
+	static BOOL deque_##type##_push_back(deque_##type var, ret_##type element) {	\
+		ret_##type slot = deque_##type##_add_back(var);							\
+		if(!slot)																\
+			return FALSE;														\
+		type##_assign(slot, element);											\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL deque_##type##_push_front(deque_##type var, ret_##type element) {	\
+		ret_##type slot = deque_##type##_add_front(var);						\
+		if(!slot)																\
+			return FALSE;														\
+		type##_assign(slot, element);											\
+		return TRUE;															\
+	}																			\
+																				\
+	/* assigns the removed element to to, unless to is NULL */					\
+	static BOOL deque_##type##_pop_back(deque_##type var, ret_##type to) {		\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(!header || header->count == 0)										\
+			return FALSE;														\
+		ret_##type slot = deque_##type##_remove_back(header);					\
+		if(to)																	\
+			type##_assign(to, slot);											\
+		type##_assign(slot, NULL);												\
+		return TRUE;															\
+	}																			\
+																				\
+	static BOOL deque_##type##_pop_front(deque_##type var, ret_##type to) {		\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(!header || header->count == 0)										\
+			return FALSE;														\
+		ret_##type slot = deque_##type##_remove_front(header);					\
+		if(to)																	\
+			type##_assign(to, slot);											\
+		type##_assign(slot, NULL);												\
+		return TRUE;															\
+	}																			\
+																				\
+	/* valid until the next push */												\
+	static ret_##type deque_##type##_get(deque_##type var, size_t pos) {		\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(header && pos < header->count)										\
+			return deque_##type##_at(header, pos);								\
+		else																	\
+			return NULL;														\
+	}																			\
+																				\
+	static BOOL deque_##type##_set(deque_##type var, size_t pos, ret_##type element) {	\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(!header || pos >= header->count)										\
+			return FALSE;														\
+		type##_assign(deque_##type##_at(header, pos), element);					\
+		return TRUE;															\
+	}																			\
+																				\
+	static void deque_##type##_clear(deque_##type var) {						\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(header) {															\
+			alloc_clear(&var->ptr, DEQUE_RING_OFFSET, header->capacity * sizeof(type));	\
+			header->head = header->count = 0;									\
+		}																		\
+	}																			\
+																				\
+	typedef type type##_deque_obj_expected_semicolon_after_macro
+
+
+// ptr_type points to an element: type* for leaf types, ret_type for managed ones
+#define INTERNAL_DEQUE_TYPE(type, ptr_type) \
+	typedef struct internal_deque_##type {										\
+		alloc_ptr ptr;															\
+	} deque_##type[1], *ret_deque_##type;										\
+																				\
+	static void deque_##type##_assign(deque_##type to, deque_##type from) {		\
+		alloc_assign(&to->ptr, from ? &from->ptr : NULL);						\
+	}																			\
+																				\
+	static void deque_##type##_global_assign(deque_##type to, deque_##type from) {	\
+		alloc_global_assign(&to->ptr, from ? &from->ptr : NULL);				\
+	}																			\
+																				\
+	static ptr_type deque_##type##_ring(deque_##type var) {						\
+		return (ptr_type)((char*)alloc_data(&var->ptr) + DEQUE_RING_OFFSET);	\
+	}																			\
+																				\
+	static size_t deque_##type##_size(deque_##type var) {						\
+		deque_header *header = alloc_data(&var->ptr);							\
+		return header ? header->count : 0;										\
+	}																			\
+																				\
+	static size_t deque_##type##_capacity(deque_##type var) {					\
+		deque_header *header = alloc_data(&var->ptr);							\
+		return header ? header->capacity : 0;									\
+	}																			\
+																				\
+	/* the element pos places after the first one */							\
+	static ptr_type deque_##type##_at(deque_header *header, size_t pos) {		\
+		return (ptr_type)((char*)header + DEQUE_RING_OFFSET) + ((header->head + pos) & (header->capacity - 1));	\
+	}																			\
+																				\
+	typedef type type##_deque_type_expected_semicolon_after_macro
+
+
+// uses deque_T_move and deque_T_zero, which differ between leaf and managed elements
+#define INTERNAL_DEQUE_FUNCTIONS(type, ptr_type) \
+	static BOOL deque_##type##_reserve(deque_##type var, size_t count) {		\
+		size_t capacity = deque_##type##_capacity(var);							\
+		size_t new_capacity = capacity ? capacity : DEQUE_MIN_CAPACITY;			\
+		if(count <= capacity)													\
+			return TRUE;														\
+		while(new_capacity < count)												\
+			new_capacity *= 2;													\
+		struct alloc_node *node = alloc_resize(var->ptr.node, DEQUE_RING_OFFSET + new_capacity * sizeof(type));	\
+		if(!node)																\
+			return FALSE;														\
+		alloc_set_node(&var->ptr, node);										\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(capacity == 0) {														\
+			header->head = header->count = 0;									\
+			alloc_keep_zeroed(&var->ptr);										\
+		}																		\
+		deque_##type##_zero(var, capacity, new_capacity - capacity);			\
+		/* a wrapped ring continues past its old end, or its first run moves to the new end */	\
+		if(header->head + header->count > capacity) {							\
+			size_t wrapped = header->head + header->count - capacity;			\
+			size_t first_run = capacity - header->head;							\
+			if(wrapped <= first_run) {											\
+				deque_##type##_move(var, capacity, 0, wrapped);					\
+			} else {															\
+				deque_##type##_move(var, new_capacity - first_run, header->head, first_run);	\
+				header->head = new_capacity - first_run;						\
+			}																	\
+		}																		\
+		header->capacity = new_capacity;										\
+		return TRUE;															\
+	}																			\
+																				\
+	static void deque_##type##_init(deque_##type var, size_t reserved) {		\
+		alloc_init(&var->ptr, 0);												\
+		deque_##type##_reserve(var, reserved);									\
+	}																			\
+																				\
+	static ret_deque_##type deque_##type##_new(size_t reserved) {				\
+		ret_deque_##type ret = alloc_return_new(0);								\
+		deque_##type##_reserve(ret, reserved);									\
+		return ret;																\
+	}																			\
+																				\
+	/* the header of a ring with room for one more element, or NULL */			\
+	static deque_header* deque_##type##_room(deque_##type var) {				\
+		deque_header *header = alloc_data(&var->ptr);							\
+		if(header && header->count < header->capacity)							\
+			return header;														\
+		if(!deque_##type##_reserve(var, deque_##type##_size(var) + 1))			\
+			return NULL;														\
+		return alloc_data(&var->ptr);											\
+	}																			\
+																				\
+	static ptr_type deque_##type##_add_back(deque_##type var) {					\
+		deque_header *header = deque_##type##_room(var);						\
+		if(!header)																\
+			return NULL;														\
+		return deque_##type##_at(header, header->count++);						\
+	}																			\
+																				\
+	static ptr_type deque_##type##_add_front(deque_##type var) {				\
+		deque_header *header = deque_##type##_room(var);						\
+		if(!header)																\
+			return NULL;														\
+		header->head = (header->head - 1) & (header->capacity - 1);				\
+		header->count++;														\
+		return deque_##type##_at(header, 0);									\
+	}																			\
+																				\
+	/* the removed element's slot */											\
+	static ptr_type deque_##type##_remove_back(deque_header *header) {			\
+		return deque_##type##_at(header, --header->count);						\
+	}																			\
+																				\
+	static ptr_type deque_##type##_remove_front(deque_header *header) {			\
+		ptr_type slot = deque_##type##_at(header, 0);							\
+		header->head = (header->head + 1) & (header->capacity - 1);				\
+		header->count--;														\
+		return slot;															\
+	}																			\
+																				\
+	typedef type type##_deque_functions_expected_semicolon_after_macro
+
+#endif
@@ -2,7 +2,7 @@
 #include <stdio.h>
 #include "array.h"
 
-TEMPLATE_ARRAY(char);
+TEMPLATE_ARRAY_SMALL(char, 24);	// lines of up to 24 bytes need no allocation
 TEMPLATE_ARRAY_TYPEDEF(char, string);
 TEMPLATE_ARRAY_OBJ(string);
 
@@ -34,7 +34,6 @@ END
 ret_array_string read_file(const char *filename)
 BEGIN
 	BOOL eof = FALSE;
-	ARRAY_INIT_NULL(char, line);
 	ARRAY_INIT(string, lines, 0, 0);
 
 	FILE *file = fopen(filename, "r");
@@ -43,9 +42,7 @@ BEGIN
 		RETURN(lines);
 
 	while(!eof) {
-		string_assign(line, read_line(file, &eof));
-
-		if(!array_string_add(lines, line))
+		if(!array_string_add(lines, read_line(file, &eof)))
 			out_of_memory();
 	}
 
@@ -57,16 +54,13 @@ END
 int main()
 BEGIN
 	ARRAY_INIT_NULL(string, lines);
-	ARRAY_INIT_NULL(char, line);
 
 	array_string_assign(lines, read_file("LICENSE"));
 
 	size_t line_count = array_string_size(lines);
 
-	for(size_t i = 0; i < line_count; i++) {
-		string_assign(line, array_string_get(lines, i));
-		printf("%03d:%s\n", (int)i, string_raw(line));
-	}
+	for(size_t i = 0; i < line_count; i++)
+		printf("%03d:%s\n", (int)i, string_raw(array_string_get(lines, i)));
 
 	RETURN_BASIC(0);
 END
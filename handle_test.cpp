@@ -0,0 +1,137 @@
+//
+// Checks alloc.hpp's handles for make check, in the same way record_test
+// checks the C containers: copies share a node, arrays of handles keep their
+// elements alive through alloc_gc, and running out of memory throws. A global
+// handle keeps its node past the outermost scope, which alloc.c does not
+// report as unfreed. Nothing is printed unless something is wrong.
+//
+//   make check
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "alloc.hpp"
+
+struct point {
+	int x, y;
+};
+
+static alloc::array<int> kept;
+
+
+static void expect(bool ok, const char *what) {
+	if(!ok) {
+		printf("%s: wrong elements\n", what);
+		exit(1);
+	}
+}
+
+
+static alloc::array<int> make_range(int count) {
+	alloc::array<int> range;
+
+	for(int i = 0; i < count; i++)
+		range.push_back(i);
+
+	return range;
+}
+
+
+static void share_leaf_arrays() {
+	alloc::array<int> range = make_range(1000);
+	alloc::array<int> copy = range;
+
+	copy[0] = 42;
+	expect(range[0] == 42 && range == copy, "alloc::array copy");
+
+	alloc::array<int> moved = std::move(copy);
+
+	expect(copy.empty() && moved.size() == 1000 && moved == range, "alloc::array move");
+
+	std::sort(moved.begin(), moved.end(), [](int a, int b) { return a > b; });
+	range.push_back(range[0]);	// from the array itself, which grows
+	alloc_gc();
+	expect(range.size() == 1001 && range[0] == 999 && range[1000] == 999, "alloc::array push_back");
+
+	range.append(range.data() + 1, 3);
+	expect(range.size() == 1004 && range[1001] == 998 && range.find(996, 1002) == 1003, "alloc::array append");
+
+	kept = range;
+}
+
+
+static void keep_handles_alive() {
+	alloc::array<alloc::array<int>> nested;
+	alloc::array<alloc::ptr<point>> points;
+
+	for(int i = 0; i < 100; i++) {
+		nested.push_back(make_range(i));
+		points.push_back(alloc::make_ptr<point>(point{ i, -i }));
+		alloc_gc();
+	}
+
+	alloc::array<int> fifty = nested[50];
+	alloc::ptr<point> three = points[3];
+
+	nested.resize(10);
+	points.set(3, alloc::ptr<point>());
+	alloc_gc();
+
+	expect(nested.size() == 10 && nested[9].size() == 9 && fifty.size() == 50 && fifty[49] == 49, "alloc::array resize");
+	expect(three->x == 3 && !points[3] && points[4]->y == -4, "alloc::array set");
+}
+
+
+// pop_back and shrink_to_fit on arrays that are or become empty
+static void empty_arrays() {
+	alloc::array<char> chars{ 'a' };
+
+	chars.pop_back();
+	chars.pop_back();
+	expect(chars.empty() && chars.capacity() == 1, "alloc::array pop_back");
+
+	chars.shrink_to_fit();
+	expect(chars.empty() && chars.capacity() == 0, "alloc::array shrink_to_fit");
+
+	chars.push_back('b');
+	expect(chars.size() == 1 && chars[0] == 'b', "alloc::array push_back");
+}
+
+
+static void run_out_of_memory() {
+	alloc::array<char> chars{ 'a' };
+	size_t max = alloc_max_memory_usage();
+	bool thrown = false;
+
+	alloc_set_max_memory_usage(alloc_memory_usage() + 4096);
+
+	try {
+		chars.reserve(8192);
+	} catch(const std::bad_alloc&) {
+		thrown = true;
+	}
+
+	alloc_set_max_memory_usage(max);
+	expect(thrown && chars.size() == 1 && chars[0] == 'a', "alloc::array reserve");
+}
+
+
+int main() {
+	{
+		alloc::scope scope(__FILE__, __LINE__);
+
+		share_leaf_arrays();
+		keep_handles_alive();
+		empty_arrays();
+		run_out_of_memory();
+	}
+
+	alloc_gc();
+	expect(kept.size() == 1004 && kept[1003] == 996, "alloc::array past the outermost scope");
+
+	kept.reset();
+	expect(alloc_memory_usage() == 0, "alloc::array reset");
+	return 0;
+}
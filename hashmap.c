@@ -0,0 +1,274 @@
+//
+// The parts of the hash maps in hashmap.h that change a table's layout:
+// claiming and erasing slots, and growing or rehashing the table.
+//
+// Growing resizes the node once and then rehashes in place. Every element is
+// marked as still to be placed, then each one is moved to the first free slot
+// of its probe sequence, swapping with any unplaced element found there, with
+// the scratch slot after the last one in between.
+//
+
+#include <string.h>
+#include "hashmap.h"
+
+
+static size_t max_load(size_t capacity) {
+	return capacity - capacity / 8;
+}
+
+
+static size_t table_size(size_t capacity, size_t slot_size) {
+	return HASHMAP_SLOTS_OFFSET + (capacity + 1) * slot_size + capacity + HASHMAP_GROUP;
+}
+
+
+static void set_ctrl(signed char *ctrl, size_t capacity, size_t pos, signed char h2) {
+	ctrl[pos] = h2;
+
+	if(pos < HASHMAP_GROUP)
+		ctrl[capacity + pos] = h2;
+}
+
+
+static size_t find_free(const signed char *ctrl, size_t mask, uint64_t hash) {
+	size_t pos = (size_t)(hash >> 7) & mask;
+
+	for(size_t step = HASHMAP_GROUP;; step += HASHMAP_GROUP) {
+		unsigned free_slots = hashmap_match_free(ctrl + pos);
+
+		if(free_slots)
+			return (pos + hashmap_first_bit(free_slots)) & mask;
+
+		pos = (pos + step) & mask;
+	}
+}
+
+
+// which of the groups along hash's probe sequence pos falls into
+static size_t probe_group(size_t pos, uint64_t hash, size_t mask) {
+	return ((pos - (size_t)(hash >> 7)) & mask) / HASHMAP_GROUP;
+}
+
+
+// Rehashes into capacity slots. The table must still be laid out for its old
+// capacity, with the node already big enough for the new one. Growing never
+// overwrites the old control bytes before reading them, as slots are at least
+// two bytes and tables at least HASHMAP_GROUP slots.
+static void rehash(char *data, size_t capacity, size_t key_size, size_t slot_size) {
+	hashmap_header *header = (hashmap_header*)data;
+	size_t old_capacity = header->capacity;
+	signed char *old_ctrl = hashmap_ctrl(data, slot_size);
+
+	header->capacity = capacity;
+
+	signed char *ctrl = hashmap_ctrl(data, slot_size);
+	char *slots = hashmap_slots(data);
+	char *scratch = slots + capacity * slot_size;
+	size_t mask = capacity - 1;
+
+	// elements still to be placed are marked deleted, everything else is empty
+	for(size_t i = 0; i < old_capacity; i++)
+		ctrl[i] = old_ctrl[i] >= 0 ? HASHMAP_DELETED : HASHMAP_EMPTY;
+
+	memset(ctrl + old_capacity, HASHMAP_EMPTY, capacity - old_capacity);
+	memcpy(ctrl + capacity, ctrl, HASHMAP_GROUP);
+
+	for(size_t i = 0; i < capacity; i++) {
+		if(ctrl[i] != HASHMAP_DELETED)
+			continue;
+
+		char *slot = slots + i * slot_size;
+		uint64_t hash = hashmap_hash(slot, key_size);
+		signed char h2 = (signed char)(hash & 0x7f);
+		size_t pos = find_free(ctrl, mask, hash);
+		char *target = slots + pos * slot_size;
+
+		if(probe_group(pos, hash, mask) == probe_group(i, hash, mask)) {
+			set_ctrl(ctrl, capacity, i, h2);
+		} else if(ctrl[pos] == HASHMAP_EMPTY) {
+			set_ctrl(ctrl, capacity, pos, h2);
+			memcpy(target, slot, slot_size);
+			set_ctrl(ctrl, capacity, i, HASHMAP_EMPTY);
+		} else {
+			// pos holds another unplaced element, which is placed next
+			set_ctrl(ctrl, capacity, pos, h2);
+			memcpy(scratch, target, slot_size);
+			memcpy(target, slot, slot_size);
+			memcpy(slot, scratch, slot_size);
+			i--;
+		}
+	}
+
+	header->growth_left = max_load(capacity) - header->count;
+}
+
+
+static BOOL resize_table(alloc_ptr *ptr, size_t capacity, size_t key_size, size_t slot_size, size_t ptr_offset) {
+	if(!ptr->node) {
+		struct alloc_node *node = alloc_resize(NULL, table_size(capacity, slot_size));
+
+		if(!node)
+			return FALSE;
+
+		alloc_set_node(ptr, node);
+
+		// slots are zeroed as they are claimed
+		if(ptr_offset != HASHMAP_END)
+			alloc_keep_zeroed(ptr);
+
+		hashmap_header *header = alloc_data(ptr);
+		header->count = 0;
+		header->capacity = capacity;
+		header->growth_left = max_load(capacity);
+		memset(hashmap_ctrl(header, slot_size), HASHMAP_EMPTY, capacity + HASHMAP_GROUP);
+		return TRUE;
+	}
+
+	if(capacity > ((hashmap_header*)alloc_data(ptr))->capacity) {
+		struct alloc_node *node = alloc_resize(ptr->node, table_size(capacity, slot_size));
+
+		if(!node)
+			return FALSE;
+
+		alloc_set_node(ptr, node);
+	}
+
+	char *data = alloc_data(ptr);
+
+	// the values' alloc_ptrs are moved with memcpy, then tracked again where they end up
+	if(ptr_offset != HASHMAP_END)
+		alloc_detach_ptrs(ptr);
+
+	rehash(data, capacity, key_size, slot_size);
+
+	if(ptr_offset != HASHMAP_END) {
+		signed char *ctrl = hashmap_ctrl(data, slot_size);
+
+		for(size_t i = 0; i < capacity; i++) {
+			if(ctrl[i] >= 0)
+				alloc_attach_ptr(ptr, (alloc_ptr*)(hashmap_slots(data) + i * slot_size + ptr_offset));
+		}
+	}
+
+	return TRUE;
+}
+
+
+size_t hashmap_add_slot(alloc_ptr *ptr, const void *key, uint64_t hash, size_t key_size, size_t slot_size, size_t ptr_offset) {
+	hashmap_header *header = alloc_data(ptr);
+
+	if(!header || header->growth_left == 0) {
+		size_t capacity = HASHMAP_GROUP;
+
+		// mostly deleted slots are cleaned up without growing
+		if(header)
+			capacity = header->count < max_load(header->capacity) / 2 ? header->capacity : header->capacity * 2;
+
+		if(!resize_table(ptr, capacity, key_size, slot_size, ptr_offset))
+			return HASHMAP_END;
+
+		header = alloc_data(ptr);
+	}
+
+	signed char *ctrl = hashmap_ctrl(header, slot_size);
+	size_t pos = find_free(ctrl, header->capacity - 1, hash);
+	char *slot = hashmap_slots(header) + pos * slot_size;
+
+	if(ctrl[pos] == HASHMAP_EMPTY) {
+		header->growth_left--;
+
+		// deleted slots still have their value's alloc_ptr tracked, empty ones do not
+		if(ptr_offset != HASHMAP_END) {
+			memset(slot + ptr_offset, 0, slot_size - ptr_offset);
+			alloc_attach_ptr(ptr, (alloc_ptr*)(slot + ptr_offset));
+		}
+	}
+
+	set_ctrl(ctrl, header->capacity, pos, (signed char)(hash & 0x7f));
+	header->count++;
+	memcpy(slot, key, key_size);
+	return pos;
+}
+
+
+BOOL hashmap_reserve_slots(alloc_ptr *ptr, size_t count, size_t key_size, size_t slot_size, size_t ptr_offset) {
+	hashmap_header *header = alloc_data(ptr);
+	size_t capacity = HASHMAP_GROUP;
+
+	// more than could ever fit, and the doubling below would overflow
+	if(count > SIZE_MAX / 4 / (slot_size + 1))
+		return FALSE;
+
+	while(max_load(capacity) < count)
+		capacity *= 2;
+
+	if(header && capacity <= header->capacity)
+		return TRUE;
+
+	return resize_table(ptr, capacity, key_size, slot_size, ptr_offset);
+}
+
+
+static size_t leading_zeros(unsigned mask) {
+	size_t zeros = 0;
+
+	for(unsigned bit = 1u << (HASHMAP_GROUP - 1); bit && !(mask & bit); bit >>= 1)
+		zeros++;
+
+	return zeros;
+}
+
+
+void hashmap_erase_slot(alloc_ptr *ptr, size_t pos, size_t slot_size, BOOL managed) {
+	hashmap_header *header = alloc_data(ptr);
+	signed char *ctrl = hashmap_ctrl(header, slot_size);
+	size_t mask = header->capacity - 1;
+
+	header->count--;
+
+	// A lookup only goes past a group without empty slots, so if the empty
+	// slots around pos leave no such run of HASHMAP_GROUP slots, no probe ever
+	// went past pos and it can become empty again.
+	if(!managed) {
+		unsigned empty_before = hashmap_match_empty(ctrl + ((pos - HASHMAP_GROUP) & mask));
+		unsigned empty_after = hashmap_match_empty(ctrl + pos);
+
+		if(empty_before && empty_after && leading_zeros(empty_before) + hashmap_first_bit(empty_after) < HASHMAP_GROUP) {
+			set_ctrl(ctrl, header->capacity, pos, HASHMAP_EMPTY);
+			header->growth_left++;
+			return;
+		}
+	}
+
+	set_ctrl(ctrl, header->capacity, pos, HASHMAP_DELETED);
+}
+
+
+void hashmap_clear_slots(alloc_ptr *ptr, size_t slot_size) {
+	hashmap_header *header = alloc_data(ptr);
+
+	if(!header)
+		return;
+
+	alloc_clear(ptr, HASHMAP_SLOTS_OFFSET, header->capacity * slot_size);
+	memset(hashmap_ctrl(header, slot_size), HASHMAP_EMPTY, header->capacity + HASHMAP_GROUP);
+	header->count = 0;
+	header->growth_left = max_load(header->capacity);
+}
+
+
+size_t hashmap_next_slot(alloc_ptr *ptr, size_t pos, size_t slot_size) {
+	hashmap_header *header = alloc_data(ptr);
+
+	if(!header)
+		return HASHMAP_END;
+
+	signed char *ctrl = hashmap_ctrl(header, slot_size);
+
+	for(; pos < header->capacity; pos++) {
+		if(ctrl[pos] >= 0)
+			return pos;
+	}
+
+	return HASHMAP_END;
+}
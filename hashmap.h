@@ -0,0 +1,343 @@
+#ifndef CONTAINER_HASHMAP_H
+#define CONTAINER_HASHMAP_H
+
+//
+// Open addressing hash maps kept in a single node, laid out like SwissTable:
+//
+//     header | capacity + 1 slots | capacity + HASHMAP_GROUP control bytes
+//
+// A slot holds a key and its value; the extra one is scratch space for
+// rehashing. Each control byte is HASHMAP_EMPTY, HASHMAP_DELETED or the low
+// 7 bits of the hash of a full slot's key. The first HASHMAP_GROUP of them are
+// repeated after the last, so a lookup can check a whole group of slots with
+// one 16-byte compare wherever its probe starts.
+//
+// Keys are hashed and compared by their bytes, like array_T_find, so they
+// should not have padding. For TEMPLATE_HASHMAP_OBJ the values must be managed
+// types with their alloc_ptr first, such as arrays and hashmaps.
+//
+// Assigning a hashmap shares its table: changes show up through every copy.
+//
+
+#include <string.h>
+#include <stdint.h>
+#include "alloc.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HASHMAP_GROUP 16
+#define HASHMAP_EMPTY ((signed char)-128)
+#define HASHMAP_DELETED ((signed char)-2)
+#define HASHMAP_END ((size_t)-1)
+
+#define HASHMAP_INIT_NULL(key, value, name) \
+	hashmap_##key##_##value name = { 0 }
+
+#define HASHMAP_INIT(key, value, name, reserved)	\
+	hashmap_##key##_##value name = { 0 };			\
+	hashmap_##key##_##value##_init(name, reserved)
+
+
+typedef struct hashmap_header {
+	size_t count;
+	size_t capacity;	// slots, a power of two and at least HASHMAP_GROUP
+	size_t growth_left;	// empty slots that can still be filled before a rehash
+} hashmap_header;
+
+// slots start 16-byte aligned after the header
+#define HASHMAP_SLOTS_OFFSET ((sizeof(hashmap_header) + 15) & ~(size_t)15)
+
+
+// Implemented in hashmap.c. ptr_offset is where a value's alloc_ptr is in a
+// slot, or HASHMAP_END for leaf values.
+
+// claims a slot for a key that is not in the table yet, growing the table if
+// needed, and returns its index or HASHMAP_END if out of memory
+size_t hashmap_add_slot(alloc_ptr *ptr, const void *key, uint64_t hash, size_t key_size, size_t slot_size, size_t ptr_offset);
+// makes room for count keys without further rehashing
+BOOL hashmap_reserve_slots(alloc_ptr *ptr, size_t count, size_t key_size, size_t slot_size, size_t ptr_offset);
+// frees a full slot whose value has already been released. Slots of maps with
+// managed values always become deleted, as their alloc_ptr stays tracked.
+void hashmap_erase_slot(alloc_ptr *ptr, size_t pos, size_t slot_size, BOOL managed);
+// releases every value and empties the table, keeping its capacity
+void hashmap_clear_slots(alloc_ptr *ptr, size_t slot_size);
+// the first full slot at or after pos, or HASHMAP_END
+size_t hashmap_next_slot(alloc_ptr *ptr, size_t pos, size_t slot_size);
+
+
+// also what alloc_intern looks its nodes up by
+static inline uint64_t hashmap_hash(const void *key, size_t size) {
+	const unsigned char *bytes = key;
+	uint64_t hash = 0x9e3779b97f4a7c15ull * (size + 1);
+	uint64_t word;
+
+	for(; size >= 8; bytes += 8, size -= 8) {
+		memcpy(&word, bytes, 8);
+		hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+		hash ^= hash >> 29;
+	}
+
+	if(size > 0) {
+		word = 0;
+		memcpy(&word, bytes, size);
+		hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+	}
+
+	// the splitmix64 finalizer, so that both the low 7 bits and the position
+	// bits depend on every bit of the key
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+	return hash ^ (hash >> 31);
+}
+
+
+// one bit per control byte in the group at ctrl
+#ifdef __SSE2__
+
+static inline unsigned hashmap_match(const signed char *ctrl, signed char h2) {
+	__m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+	return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h2)));
+}
+
+// empty and deleted are the only control bytes below -1
+static inline unsigned hashmap_match_free(const signed char *ctrl) {
+	__m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+	return (unsigned)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), group));
+}
+
+#else
+
+static inline unsigned hashmap_match(const signed char *ctrl, signed char h2) {
+	unsigned mask = 0;
+
+	for(int i = 0; i < HASHMAP_GROUP; i++)
+		mask |= (unsigned)(ctrl[i] == h2) << i;
+
+	return mask;
+}
+
+static inline unsigned hashmap_match_free(const signed char *ctrl) {
+	unsigned mask = 0;
+
+	for(int i = 0; i < HASHMAP_GROUP; i++)
+		mask |= (unsigned)(ctrl[i] < -1) << i;
+
+	return mask;
+}
+
+#endif
+
+static inline unsigned hashmap_match_empty(const signed char *ctrl) {
+	return hashmap_match(ctrl, HASHMAP_EMPTY);
+}
+
+
+static inline size_t hashmap_first_bit(unsigned mask) {
+#ifdef __GNUC__
+	return (size_t)__builtin_ctz(mask);
+#else
+	size_t i = 0;
+
+	for(; !(mask & 1); mask >>= 1)
+		i++;
+
+	return i;
+#endif
+}
+
+
+static inline char *hashmap_slots(void *data) {
+	return (char*)data + HASHMAP_SLOTS_OFFSET;
+}
+
+
+static inline signed char *hashmap_ctrl(void *data, size_t slot_size) {
+	return (signed char*)(hashmap_slots(data) + (((hashmap_header*)data)->capacity + 1) * slot_size);
+}
+
+
+// Probes group by group, stepping 16, 32, 48... slots further each time,
+// which visits every group of a power-of-two table. There is always an empty
+// slot to stop at, as the table is rehashed before it is 7/8 full.
+static inline size_t hashmap_find_slot(void *data, const void *key, uint64_t hash, size_t key_size, size_t slot_size) {
+	size_t mask = ((hashmap_header*)data)->capacity - 1;
+	char *slots = hashmap_slots(data);
+	signed char *ctrl = hashmap_ctrl(data, slot_size);
+	signed char h2 = (signed char)(hash & 0x7f);
+	size_t pos = (size_t)(hash >> 7) & mask;
+
+	for(size_t step = HASHMAP_GROUP;; step += HASHMAP_GROUP) {
+		for(unsigned match = hashmap_match(ctrl + pos, h2); match; match &= match - 1) {
+			size_t i = (pos + hashmap_first_bit(match)) & mask;
+
+			if(memcmp(slots + i * slot_size, key, key_size) == 0)
+				return i;
+		}
+
+		if(hashmap_match_empty(ctrl + pos))
+			return HASHMAP_END;
+
+		pos = (pos + step) & mask;
+	}
+}
+
+
+#define TEMPLATE_HASHMAP(key, value) \
+	INTERNAL_HASHMAP_FUNCTIONS(key, value, HASHMAP_END);						\
+																				\
+	static BOOL hashmap_##key##_##value##_put(hashmap_##key##_##value map, key k, value v) {	\
+		size_t pos = hashmap_##key##_##value##_find_or_add(map, k);				\
+		if(pos == HASHMAP_END)													\
+			return FALSE;														\
+		hashmap_##key##_##value##_slots(map)[pos].v = v;						\
+		return TRUE;															\
+	}																			\
+																				\
+	static value hashmap_##key##_##value##_get(hashmap_##key##_##value map, key k) {	\
+		value v = {0};															\
+		size_t pos = hashmap_##key##_##value##_find(map, k);					\
+		if(pos != HASHMAP_END)													\
+			v = hashmap_##key##_##value##_slots(map)[pos].v;					\
+		return v;																\
+	}																			\
+																				\
+	static value hashmap_##key##_##value##_value_at(hashmap_##key##_##value map, size_t pos) {	\
+		return hashmap_##key##_##value##_slots(map)[pos].v;						\
+	}																			\
+																				\
+	static BOOL hashmap_##key##_##value##_remove(hashmap_##key##_##value map, key k) {	\
+		size_t pos = hashmap_##key##_##value##_find(map, k);					\
+		if(pos == HASHMAP_END)													\
+			return FALSE;														\
+		hashmap_erase_slot(&map->ptr, pos, sizeof(internal_hashmap_##key##_##value##_slot), FALSE);	\
+		return TRUE;															\
+	}																			\
+																				\
+	typedef value hashmap_##key##_##value##_expected_semicolon_after_macro
+
+
+#define TEMPLATE_HASHMAP_OBJ(key, value) \
+	INTERNAL_HASHMAP_FUNCTIONS(key, value, offsetof(internal_hashmap_##key##_##value##_slot, v));	\
+																				\
+	static BOOL hashmap_##key##_##value##_put(hashmap_##key##_##value map, key k, ret_##value v) {	\
+		size_t pos = hashmap_##key##_##value##_find_or_add(map, k);				\
+		if(pos == HASHMAP_END)													\
+			return FALSE;														\
+		value##_assign(hashmap_##key##_##value##_slots(map)[pos].v, v);			\
+		return TRUE;															\
+	}																			\
+																				\
+	/* valid until the next put */												\
+	static ret_##value hashmap_##key##_##value##_get(hashmap_##key##_##value map, key k) {	\
+		size_t pos = hashmap_##key##_##value##_find(map, k);					\
+		if(pos == HASHMAP_END)													\
+			return NULL;														\
+		return hashmap_##key##_##value##_slots(map)[pos].v;						\
+	}																			\
+																				\
+	static ret_##value hashmap_##key##_##value##_value_at(hashmap_##key##_##value map, size_t pos) {	\
+		return hashmap_##key##_##value##_slots(map)[pos].v;						\
+	}																			\
+																				\
+	static BOOL hashmap_##key##_##value##_remove(hashmap_##key##_##value map, key k) {	\
+		size_t pos = hashmap_##key##_##value##_find(map, k);					\
+		if(pos == HASHMAP_END)													\
+			return FALSE;														\
+		value##_assign(hashmap_##key##_##value##_slots(map)[pos].v, NULL);		\
+		hashmap_erase_slot(&map->ptr, pos, sizeof(internal_hashmap_##key##_##value##_slot), TRUE);	\
+		return TRUE;															\
+	}																			\
+																				\
+	typedef value hashmap_##key##_##value##obj_expected_semicolon_after_macro
+
+
+#define INTERNAL_HASHMAP_FUNCTIONS(key, value, ptr_offset) \
+	typedef struct internal_hashmap_##key##_##value {							\
+		alloc_ptr ptr;															\
+	} hashmap_##key##_##value[1], *ret_hashmap_##key##_##value;					\
+																				\
+	typedef struct internal_hashmap_##key##_##value##_slot {					\
+		key k;																	\
+		value v;																\
+	} internal_hashmap_##key##_##value##_slot;									\
+																				\
+	/* room for reserved keys without a rehash. Without memory for it the map */	\
+	/* is empty with a capacity of 0, and _new returns NULL, as for arrays. */	\
+	static void hashmap_##key##_##value##_init(hashmap_##key##_##value map, size_t reserved) {	\
+		alloc_init(&map->ptr, 0);												\
+		if(reserved > 0)														\
+			hashmap_reserve_slots(&map->ptr, reserved, sizeof(key), sizeof(internal_hashmap_##key##_##value##_slot), ptr_offset);	\
+	}																			\
+																				\
+	static ret_hashmap_##key##_##value hashmap_##key##_##value##_new(size_t reserved) {	\
+		ret_hashmap_##key##_##value ret = alloc_return_new(0);					\
+		if(reserved > 0 && !hashmap_reserve_slots(&ret->ptr, reserved, sizeof(key), sizeof(internal_hashmap_##key##_##value##_slot), ptr_offset))	\
+			return NULL;														\
+		return ret;																\
+	}																			\
+																				\
+	static void hashmap_##key##_##value##_assign(hashmap_##key##_##value to, hashmap_##key##_##value from) {	\
+		alloc_assign(&to->ptr, from ? &from->ptr : NULL);						\
+	}																			\
+																				\
+	static void hashmap_##key##_##value##_global_assign(hashmap_##key##_##value to, hashmap_##key##_##value from) {	\
+		alloc_global_assign(&to->ptr, from ? &from->ptr : NULL);				\
+	}																			\
+																				\
+	static internal_hashmap_##key##_##value##_slot* hashmap_##key##_##value##_slots(hashmap_##key##_##value map) {	\
+		return (internal_hashmap_##key##_##value##_slot*)hashmap_slots(alloc_data(&map->ptr));	\
+	}																			\
+																				\
+	static size_t hashmap_##key##_##value##_size(hashmap_##key##_##value map) {	\
+		return map->ptr.node ? ((hashmap_header*)alloc_data(&map->ptr))->count : 0;	\
+	}																			\
+																				\
+	/* how many keys fit before the table has to grow */						\
+	static size_t hashmap_##key##_##value##_capacity(hashmap_##key##_##value map) {	\
+		hashmap_header *header = alloc_data(&map->ptr);							\
+		return header ? header->count + header->growth_left : 0;				\
+	}																			\
+																				\
+	static BOOL hashmap_##key##_##value##_reserve(hashmap_##key##_##value map, size_t count) {	\
+		return hashmap_reserve_slots(&map->ptr, count, sizeof(key), sizeof(internal_hashmap_##key##_##value##_slot), ptr_offset);	\
+	}																			\
+																				\
+	/* k's slot, for key_at and value_at, or HASHMAP_END */						\
+	static size_t hashmap_##key##_##value##_find(hashmap_##key##_##value map, key k) {	\
+		if(!map->ptr.node)														\
+			return HASHMAP_END;													\
+		return hashmap_find_slot(alloc_data(&map->ptr), &k, hashmap_hash(&k, sizeof(key)), sizeof(key), sizeof(internal_hashmap_##key##_##value##_slot));	\
+	}																			\
+																				\
+	static size_t hashmap_##key##_##value##_find_or_add(hashmap_##key##_##value map, key k) {	\
+		uint64_t hash = hashmap_hash(&k, sizeof(key));							\
+		size_t pos = HASHMAP_END;												\
+		if(map->ptr.node)														\
+			pos = hashmap_find_slot(alloc_data(&map->ptr), &k, hash, sizeof(key), sizeof(internal_hashmap_##key##_##value##_slot));	\
+		if(pos == HASHMAP_END)													\
+			pos = hashmap_add_slot(&map->ptr, &k, hash, sizeof(key), sizeof(internal_hashmap_##key##_##value##_slot), ptr_offset);	\
+		return pos;																\
+	}																			\
+																				\
+	static BOOL hashmap_##key##_##value##_contains(hashmap_##key##_##value map, key k) {	\
+		return hashmap_##key##_##value##_find(map, k) != HASHMAP_END;			\
+	}																			\
+																				\
+	/* for(size_t i = next(map, 0); i != HASHMAP_END; i = next(map, i + 1)) */	\
+	static size_t hashmap_##key##_##value##_next(hashmap_##key##_##value map, size_t pos) {	\
+		return hashmap_next_slot(&map->ptr, pos, sizeof(internal_hashmap_##key##_##value##_slot));	\
+	}																			\
+																				\
+	static key hashmap_##key##_##value##_key_at(hashmap_##key##_##value map, size_t pos) {	\
+		return hashmap_##key##_##value##_slots(map)[pos].k;						\
+	}																			\
+																				\
+	static void hashmap_##key##_##value##_clear(hashmap_##key##_##value map) {	\
+		hashmap_clear_slots(&map->ptr, sizeof(internal_hashmap_##key##_##value##_slot));	\
+	}																			\
+																				\
+	typedef key hashmap_##key##_##value##_internal_expected_semicolon_after_macro
+
+#endif
@@ -0,0 +1,576 @@
+//
+// Records a trace for make check to replay: every container grows from empty
+// with an alloc_gc between growths, so a node the replay loses track of is
+// freed while the container still uses it. Arrays also grow by copies of their
+// own elements, which have to be read from where the growth put them. Slices
+// and the arrays they come from copy their elements before writing to them,
+// while plain copies of an array keep sharing its writes.
+//
+// Hash maps erase keys and reuse the slots they leave, which for arrays of
+// values are tombstones until the table is rehashed in place.
+//
+// Interned arrays share one node per contents until they are written to, and
+// the intern table lets go of nodes once nothing else holds them.
+//
+// Snapshots cannot be loaded while recording, so they are checked once the
+// trace is written: a round trip keeps nodes shared, and a truncated snapshot
+// loads nothing.
+//
+//   ./record_test trace.bin && ./replay trace.bin
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "array.h"
+#include "hashmap.h"
+#include "deque.h"
+
+#define GROWTHS 64
+#define SNAPSHOT_FILE "record_test.snapshot"
+
+typedef char small_char;
+
+TEMPLATE_ARRAY(char);
+TEMPLATE_ARRAY_SMALL(small_char, 8);
+TEMPLATE_ARRAY_OBJ(array_char);
+TEMPLATE_HASHMAP(int, int);
+TEMPLATE_HASHMAP_OBJ(int, array_char);
+TEMPLATE_DEQUE(int);
+TEMPLATE_DEQUE_OBJ(array_char);
+
+
+static void out_of_memory() {
+	puts("Ran out of memory.");
+	exit(1);
+}
+
+
+static void expect(BOOL ok, const char *what) {
+	if(!ok) {
+		printf("%s: wrong elements\n", what);
+		exit(1);
+	}
+}
+
+
+static void grow_containers()
+BEGIN
+	ARRAY_INIT_NULL(char, chars);
+	ARRAY_INIT(char, empty_chars, 0, 0);
+	ARRAY_INIT(small_char, small_chars, 0, 0);
+	ARRAY_INIT(array_char, arrays, 0, 0);
+	ARRAY_INIT(array_char, reserved_arrays, 4, 4);
+	ARRAY_INIT_NULL(array_char, made_arrays);
+	HASHMAP_INIT(int, int, map, 0);
+	DEQUE_INIT(int, queue, 0);
+
+	array_char_assign(chars, NULL);
+	alloc_gc();
+
+	if(!array_array_char_set(reserved_arrays, 0, empty_chars))
+		out_of_memory();
+
+	for(int i = 0; i < GROWTHS; i++) {
+		if(!array_char_add(chars, 'a') || !array_char_add(empty_chars, 'b') || !array_small_char_add(small_chars, 'c')
+				|| !array_array_char_add(arrays, chars) || !hashmap_int_int_put(map, i, i) || !deque_int_push_back(queue, i))
+			out_of_memory();
+
+		alloc_gc();
+	}
+
+	// a typed node made for the pending return value, collected around while
+	// still pending, then grown
+	for(int i = 0; i < GROWTHS; i++) {
+		ret_array_array_char made = array_array_char_new(i % 4 + 1);
+		alloc_gc();
+		array_array_char_assign(made_arrays, made);
+
+		if(!array_array_char_add(made_arrays, chars))
+			out_of_memory();
+
+		alloc_gc();
+	}
+
+	RETURN_VOID;
+END
+
+
+// each copy starts from a full array, so it grows and moves the elements copied
+static void copy_from_self()
+BEGIN
+	ARRAY_INIT(char, chars, 4, 4);
+	ARRAY_INIT(array_char, arrays, 0, 0);
+	ARRAY_INIT_NULL(char, made);
+
+	memcpy(array_char_raw(chars), "abcd", 4);
+
+	if(!array_char_append_n(chars, array_char_raw(chars), 4))
+		out_of_memory();
+
+	expect(array_char_size(chars) == 8 && !memcmp(array_char_raw(chars), "abcdabcd", 8), "array_char_append_n");
+
+	// "bcda" from 1, of which "cda" is past the insertion point
+	if(!array_char_shrink_to_fit(chars) || !array_char_insert_range(chars, 2, array_char_raw(chars) + 1, 4))
+		out_of_memory();
+
+	expect(array_char_size(chars) == 12 && !memcmp(array_char_raw(chars), "abbcdacdabcd", 12), "array_char_insert_range");
+
+	// arrays of 1, 2 and 3 elements, told apart by their sizes
+	for(size_t i = 0; i < 3; i++) {
+		array_char_assign(made, array_char_new(i + 1));
+
+		if(!array_array_char_add(arrays, made))
+			out_of_memory();
+	}
+
+	if(!array_array_char_shrink_to_fit(arrays) || !array_array_char_append_n(arrays, array_array_char_raw(arrays), 3))
+		out_of_memory();
+
+	alloc_gc();
+
+	if(!array_array_char_shrink_to_fit(arrays) || !array_array_char_add(arrays, &array_array_char_raw(arrays)[2]))
+		out_of_memory();
+
+	alloc_gc();
+
+	if(!array_array_char_shrink_to_fit(arrays) || !array_array_char_insert_range(arrays, 1, array_array_char_raw(arrays), 3))
+		out_of_memory();
+
+	alloc_gc();
+
+	static const size_t sizes[] = { 1, 1, 2, 3, 2, 3, 1, 2, 3, 3 };
+	ret_array_char elements = array_array_char_raw(arrays);
+
+	expect(array_array_char_size(arrays) == 10, "array_array_char_insert_range");
+
+	for(size_t i = 0; i < 10; i++)
+		expect(array_char_size(&elements[i]) == sizes[i], "array_array_char_insert_range");
+
+	RETURN_VOID;
+END
+
+
+// A full ring whose first element is at head grows by one more, which moves
+// either its wrapped part past the old end or its first run to the new end.
+// Elements are pushed at both ends so the ring wraps either way.
+static void grow_wrapped_deques(size_t head)
+BEGIN
+	DEQUE_INIT(int, queue, 0);
+	DEQUE_INIT(array_char, arrays, 0);
+	ARRAY_INIT_NULL(char, made);
+
+	for(size_t i = 0; i < head; i++) {
+		if(!deque_int_push_back(queue, -1) || !deque_array_char_push_back(arrays, made))
+			out_of_memory();
+	}
+
+	for(size_t i = 0; i < head; i++) {
+		deque_int_pop_front(queue);
+		deque_array_char_pop_front(arrays, NULL);
+	}
+
+	// 1 to DEQUE_MIN_CAPACITY + 1 from the front, with 0 pushed there last
+	for(int i = 1; i <= DEQUE_MIN_CAPACITY + 1; i++) {
+		array_char_assign(made, array_char_new(i));
+
+		if(!deque_int_push_back(queue, i) || !deque_array_char_push_back(arrays, made))
+			out_of_memory();
+
+		alloc_gc();
+	}
+
+	array_char_assign(made, NULL);
+
+	if(!deque_int_push_front(queue, 0) || !deque_array_char_push_front(arrays, made))
+		out_of_memory();
+
+	alloc_gc();
+	expect(deque_int_size(queue) == DEQUE_MIN_CAPACITY + 2, "deque_int_reserve");
+	expect(deque_array_char_size(arrays) == DEQUE_MIN_CAPACITY + 2, "deque_array_char_reserve");
+
+	for(int i = 0; i <= DEQUE_MIN_CAPACITY + 1; i++) {
+		expect(deque_int_pop_front(queue) == i, "deque_int_reserve");
+		expect(deque_array_char_pop_front(arrays, made) && array_char_size(made) == (size_t)i, "deque_array_char_reserve");
+		alloc_gc();
+	}
+
+	RETURN_VOID;
+END
+
+
+// an array_char in a node's data, whose alloc_ptr has a next copied in with it
+// but is not tracked, is tracked once it is assigned to
+static void assign_into_copied_memory()
+BEGIN
+	ARRAY_INIT(char, chars, 4, 4);
+	alloc_ptr holder;
+
+	alloc_init(&holder, sizeof(array_char));
+
+	ret_array_char copied = alloc_data(&holder);
+
+	memcpy(array_char_raw(chars), "abcd", 4);
+	memcpy(copied, chars, sizeof(array_char));
+	copied->ptr.node = NULL;
+
+	array_char_assign(copied, chars);
+	array_char_assign(chars, NULL);
+
+	size_t usage = alloc_memory_usage();
+	alloc_gc();
+
+	expect(alloc_memory_usage() == usage, "alloc_assign");
+	expect(array_char_size(copied) == 4 && !memcmp(array_char_raw(copied), "abcd", 4), "alloc_assign");
+
+	RETURN_VOID;
+END
+
+
+static ret_array_char make_chars(const char *text)
+BEGIN
+	ARRAY_INIT(char, chars, 0, 0);
+
+	if(!array_char_append_n(chars, text, strlen(text)))
+		out_of_memory();
+
+	RETURN(chars);
+END
+
+
+static BOOL holds(array_char chars, const char *text) {
+	return array_char_size(chars) == strlen(text) && !memcmp(array_char_raw(chars), text, strlen(text));
+}
+
+
+// writes through a slice and through its source go to copies, writes through
+// plain copies, made before the slice or from a returned array, do not
+static void diverge_slices()
+BEGIN
+	ARRAY_INIT_NULL(char, text);
+	ARRAY_INIT_NULL(char, copy);
+	ARRAY_INIT_NULL(char, word);
+	ARRAY_INIT(small_char, small_text, 0, 0);
+	ARRAY_INIT_NULL(small_char, small_word);
+
+	array_char_assign(text, make_chars("hello world"));
+	array_char_assign(copy, text);
+
+	if(!array_char_slice(word, text, 6, 5) || !array_char_set(word, 0, 'W'))
+		out_of_memory();
+
+	expect(holds(word, "World") && holds(text, "hello world"), "array_char_slice");
+
+	if(!array_char_set(text, 0, 'H'))
+		out_of_memory();
+
+	alloc_gc();
+	expect(holds(text, "Hello world") && holds(copy, "hello world") && holds(word, "World"), "array_char_slice");
+
+	// no slice of copy's node is left, so writes through it are shared again
+	array_char_assign(text, copy);
+	size_t usage = alloc_memory_usage();
+
+	if(!array_char_set(copy, 0, 'j'))
+		out_of_memory();
+
+	expect(alloc_memory_usage() == usage && holds(text, "jello world"), "array_char_assign");
+
+	// the pending return is no other user of the node
+	array_char_assign(text, make_chars("pending"));
+	usage = alloc_memory_usage();
+
+	if(!array_char_set(text, 0, 'P'))
+		out_of_memory();
+
+	expect(alloc_memory_usage() == usage && holds(text, "Pending"), "array_char_set");
+
+	// past the inline elements, so small_word views small_text's node
+	if(!array_small_char_append_n(small_text, "hello world", 11) || !array_small_char_slice(small_word, small_text, 6, 5)
+			|| !array_small_char_set(small_word, 0, 'W'))
+		out_of_memory();
+
+	alloc_gc();
+	expect(array_small_char_size(small_word) == 5 && !memcmp(array_small_char_raw(small_word), "World", 5)
+		&& !memcmp(array_small_char_raw(small_text), "hello world", 11), "array_small_char_slice");
+
+	RETURN_VOID;
+END
+
+
+// Keys 0 to GROWTHS - 1 stay, with every other one erased. Then each new key
+// is put and erased again, which fills the table with erased slots until it
+// is rehashed in place, keeping its node and the arrays of the kept keys.
+static void erase_hashmap_keys()
+BEGIN
+	HASHMAP_INIT(int, int, map, 0);
+	HASHMAP_INIT(int, array_char, arrays, 0);
+	ARRAY_INIT_NULL(char, made);
+
+	expect(hashmap_int_int_new(SIZE_MAX / 2) == NULL, "hashmap_int_int_new");
+
+	for(int i = 0; i < GROWTHS; i++) {
+		array_char_assign(made, array_char_new(i % 4 + 1));
+
+		if(!hashmap_int_int_put(map, i, i) || !hashmap_int_array_char_put(arrays, i, made))
+			out_of_memory();
+	}
+
+	for(int i = 1; i < GROWTHS; i += 2)
+		expect(hashmap_int_int_remove(map, i) && hashmap_int_array_char_remove(arrays, i), "hashmap_remove");
+
+	// the pending return value holds an array of one element, as it does below
+	array_char_assign(made, array_char_new(1));
+	array_char_assign(made, NULL);
+	alloc_gc();
+	size_t usage = alloc_memory_usage();
+
+	for(int i = GROWTHS; i < GROWTHS * 16; i++) {
+		array_char_assign(made, array_char_new(1));
+
+		if(!hashmap_int_int_put(map, i, i) || !hashmap_int_array_char_put(arrays, i, made))
+			out_of_memory();
+
+		expect(hashmap_int_int_remove(map, i) && hashmap_int_array_char_remove(arrays, i), "hashmap_remove");
+		alloc_gc();
+	}
+
+	array_char_assign(made, NULL);
+	alloc_gc();
+	expect(alloc_memory_usage() == usage, "hashmap_add_slot");
+	expect(hashmap_int_int_size(map) == GROWTHS / 2 && hashmap_int_array_char_size(arrays) == GROWTHS / 2, "hashmap_remove");
+
+	for(int i = 0; i < GROWTHS; i++) {
+		ret_array_char value = hashmap_int_array_char_get(arrays, i);
+
+		expect(hashmap_int_int_contains(map, i) == (i % 2 == 0), "hashmap_int_int_remove");
+		expect(i % 2 ? !value : value && array_char_size(value) == (size_t)i % 4 + 1, "hashmap_int_array_char_remove");
+	}
+
+	RETURN_VOID;
+END
+
+
+// GROWTHS * 4 numbers interned, every other one kept and interned again once
+// the others are collected, which grows the intern table and then takes
+// entries out of it
+static void reclaim_interned()
+BEGIN
+	ARRAY_INIT(array_char, kept, 0, 0);
+	ARRAY_INIT(char, text, 0, 0);
+	ARRAY_INIT_NULL(char, interned);
+	char number[16];
+
+	alloc_gc();
+	size_t usage = alloc_memory_usage();
+
+	for(int i = 0; i < GROWTHS * 4; i++) {
+		snprintf(number, sizeof number, "%d", i);
+		array_char_clear(text);
+
+		if(!array_char_append_n(text, number, strlen(number)) || !array_char_intern(interned, text)
+				|| (i % 2 == 0 && !array_array_char_add(kept, interned)))
+			out_of_memory();
+
+		alloc_gc();
+	}
+
+	array_char_assign(interned, NULL);
+	alloc_gc();
+
+	for(int i = 0; i < GROWTHS * 4; i++) {
+		snprintf(number, sizeof number, "%d", i);
+		array_char_clear(text);
+
+		if(!array_char_append_n(text, number, strlen(number)) || !array_char_intern(interned, text))
+			out_of_memory();
+
+		expect(holds(interned, number) && array_char_is_interned(interned), "array_char_intern");
+		expect(i % 2 || interned->ptr.node == array_array_char_raw(kept)[i / 2].ptr.node, "array_char_intern");
+	}
+
+	// a write goes to a copy, which is not interned
+	array_char_assign(text, interned);
+
+	if(!array_char_set(text, 0, 'x'))
+		out_of_memory();
+
+	expect(!array_char_is_interned(text) && array_char_is_interned(interned) && holds(interned, number), "array_char_set");
+
+	array_char_assign(text, NULL);
+	array_char_assign(interned, NULL);
+	array_array_char_assign(kept, NULL);
+	alloc_gc();
+	expect(alloc_memory_usage() == usage, "alloc_intern");
+
+	RETURN_VOID;
+END
+
+
+// Past a small mmap threshold nodes grow and shrink by remapping, except for
+// shrinks that drop alloc_ptrs, which copy and then release them.
+static void remap_nodes()
+BEGIN
+	ARRAY_INIT(char, chars, 0, 0);
+	ARRAY_INIT(array_char, arrays, 0, 0);
+	ARRAY_INIT_NULL(char, made);
+	size_t threshold = alloc_mmap_threshold();
+	size_t count = GROWTHS * 8;
+
+	alloc_set_mmap_threshold(256);
+
+	for(size_t i = 0; i < count; i++) {
+		array_char_assign(made, array_char_new(i % 4 + 1));
+
+		if(!array_char_add(chars, (char)i) || !array_array_char_add(arrays, made))
+			out_of_memory();
+
+		alloc_gc();
+	}
+
+	array_char_assign(made, NULL);
+
+	if(!array_char_resize(chars, count / 2) || !array_char_shrink_to_fit(chars) || !array_array_char_shrink_to_fit(arrays))
+		out_of_memory();
+
+	alloc_gc();
+	size_t usage = alloc_memory_usage();
+
+	// the last GROWTHS arrays, which nothing else holds
+	struct alloc_node *node = alloc_resize(arrays->ptr.node, (count - GROWTHS) * sizeof(array_char));
+
+	if(!node)
+		out_of_memory();
+
+	alloc_set_node(&arrays->ptr, node);
+	arrays->elements_used = count - GROWTHS;
+	alloc_gc();
+	expect(alloc_memory_usage() < usage && array_array_char_size(arrays) == count - GROWTHS, "alloc_resize");
+
+	for(size_t i = 0; i < count - GROWTHS; i++)
+		expect(array_char_size(&array_array_char_raw(arrays)[i]) == i % 4 + 1, "alloc_resize");
+
+	for(size_t i = 0; i < count / 2; i++)
+		expect(array_char_raw(chars)[i] == (char)i, "alloc_resize");
+
+	// an array_char past the new end of a node without a type
+	alloc_ptr holder;
+	alloc_init(&holder, 512);
+
+	ret_array_char held = (ret_array_char)((char*)alloc_data(&holder) + 384);
+
+	held->ptr.node = NULL;
+	array_char_assign(held, chars);
+	array_char_assign(chars, NULL);
+	usage = alloc_memory_usage();
+
+	if(!(node = alloc_resize(holder.node, 300)))
+		out_of_memory();
+
+	alloc_set_node(&holder, node);
+	alloc_gc();
+	expect(alloc_size(&holder) == 300 && alloc_memory_usage() <= usage - (512 - 300) - count / 2, "alloc_resize");
+
+	alloc_set_mmap_threshold(threshold);
+	RETURN_VOID;
+END
+
+
+// "ab", "cde" and the node of "ab" again
+static void save_lines()
+BEGIN
+	ARRAY_INIT(array_char, lines, 0, 0);
+	ARRAY_INIT_NULL(char, line);
+
+	array_char_assign(line, make_chars("ab"));
+
+	if(!array_array_char_add(lines, line) || !array_array_char_add(lines, make_chars("cde"))
+			|| !array_array_char_add(lines, line))
+		out_of_memory();
+
+	expect(SNAPSHOT_SAVE(lines, SNAPSHOT_FILE), "alloc_snapshot_save");
+	RETURN_VOID;
+END
+
+
+static void load_while_recording()
+BEGIN
+	ARRAY_INIT(array_char, lines, 1, 1);
+
+	save_lines();
+	expect(!SNAPSHOT_LOAD(lines, SNAPSHOT_FILE) && !lines->ptr.node && !array_array_char_size(lines), "alloc_snapshot_load");
+
+	RETURN_VOID;
+END
+
+
+static void load_snapshots()
+BEGIN
+	ARRAY_INIT_NULL(array_char, lines);
+
+	save_lines();
+
+	if(!SNAPSHOT_LOAD(lines, SNAPSHOT_FILE))
+		out_of_memory();
+
+	alloc_gc();
+
+	ret_array_char loaded = array_array_char_raw(lines);
+
+	expect(array_array_char_size(lines) == 3 && holds(&loaded[0], "ab") && holds(&loaded[1], "cde")
+		&& loaded[2].ptr.node == loaded[0].ptr.node, "alloc_snapshot_load");
+
+	// all but the last byte of the snapshot
+	FILE *file = fopen(SNAPSHOT_FILE, "rb");
+	char bytes[4096];
+	size_t size = file ? fread(bytes, 1, sizeof bytes, file) : 0;
+
+	if(file)
+		fclose(file);
+
+	file = fopen(SNAPSHOT_FILE, "wb");
+	expect(file && size > 0 && size < sizeof bytes && fwrite(bytes, 1, size - 1, file) == size - 1, "alloc_snapshot_save");
+	fclose(file);
+
+	array_array_char_assign(lines, NULL);
+	alloc_gc();
+
+	size_t usage = alloc_memory_usage();
+
+	expect(!SNAPSHOT_LOAD(lines, SNAPSHOT_FILE) && !lines->ptr.node && !array_array_char_size(lines), "alloc_snapshot_load");
+	alloc_gc();
+	expect(alloc_memory_usage() == usage, "alloc_snapshot_load");
+
+	remove(SNAPSHOT_FILE);
+	RETURN_VOID;
+END
+
+
+int main(int argc, char **argv) {
+	if(argc < 2) {
+		fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+		return 1;
+	}
+
+	if(!alloc_record_start(argv[1])) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	BEGIN
+	grow_containers();
+	copy_from_self();
+	grow_wrapped_deques(2);
+	grow_wrapped_deques(DEQUE_MIN_CAPACITY - 2);
+	assign_into_copied_memory();
+	diverge_slices();
+	erase_hashmap_keys();
+	reclaim_interned();
+	remap_nodes();
+	load_while_recording();
+	END
+
+	alloc_record_stop();
+	load_snapshots();
+	return 0;
+}
@@ -0,0 +1,809 @@
+//
+// Re-executes an allocation trace recorded with alloc_record_start() (see
+// alloc_record.h) against alloc.c, and reports throughput, peak memory_usage,
+// the pauses of explicit alloc_gc calls, how many other collections the memory
+// limit caused, and peak RSS.
+//
+//   cc -O2 -DNDEBUG -o replay replay.c alloc.c
+//   ./replay trace.bin
+//
+// Addresses in the trace are mapped to the nodes and alloc_ptrs created during
+// the replay. Stack and static alloc_ptrs become slots owned by the replayed
+// frame that first used them, except for those of alloc_roots, which are kept
+// until the end.
+//
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "alloc.h"
+#include "alloc_record.h"
+
+#define SLOTS_PER_CHUNK 64
+
+
+typedef struct map_entry {
+	uint64_t key;	// 0 is never a valid address, so it marks empty entries
+	void *value;
+} map_entry;
+
+typedef struct address_map {
+	map_entry *entries;
+	size_t capacity;
+	size_t count;
+} address_map;
+
+// large enough for alloc_return to copy a whole array handle out of it
+typedef union replay_slot {
+	alloc_ptr ptr;
+	char bytes[sizeof(((alloc_frame*)0)->return_value)];
+} replay_slot;
+
+typedef struct slot_chunk {
+	struct slot_chunk *next;
+	size_t used;
+	replay_slot slots[SLOTS_PER_CHUNK];
+} slot_chunk;
+
+typedef struct replay_frame {
+	alloc_frame frame;
+	struct replay_frame *parent;
+	slot_chunk *chunks;
+	map_entry *undo;	// slot map entries this frame replaced, restored when it ends
+	size_t undo_count;
+	size_t undo_capacity;
+} replay_frame;
+
+typedef struct replay {
+	const unsigned char *pos;
+	const unsigned char *end;
+	address_map nodes;
+	address_map slots;
+	address_map roots;	// alloc_roots by address, kept across frames until the end
+	replay_frame *frame;
+	replay_frame *root;
+	alloc_type **types;	// the layouts of typed nodes, each one kept once until the end
+	size_t type_count;
+	BOOL error;
+} replay;
+
+
+static void out_of_memory() {
+	puts("Ran out of memory.");
+	exit(1);
+}
+
+
+static size_t map_index(const address_map *map, uint64_t key) {
+	key ^= key >> 29;
+	key *= 0x9e3779b97f4a7c15u;
+	return (size_t)(key >> 32) & (map->capacity - 1);
+}
+
+
+static void *map_get(const address_map *map, uint64_t key) {
+	if(!map->capacity)
+		return NULL;
+
+	size_t i = map_index(map, key);
+
+	while(map->entries[i].key) {
+		if(map->entries[i].key == key)
+			return map->entries[i].value;
+		i = (i + 1) & (map->capacity - 1);
+	}
+
+	return NULL;
+}
+
+
+static void map_remove(address_map *map, uint64_t key) {
+	if(!map->capacity)
+		return;
+
+	size_t mask = map->capacity - 1;
+	size_t i = map_index(map, key);
+
+	while(map->entries[i].key != key) {
+		if(!map->entries[i].key)
+			return;
+		i = (i + 1) & mask;
+	}
+
+	// shift later entries of the probe run back so lookups never stop early
+	size_t hole = i;
+
+	for(i = (i + 1) & mask; map->entries[i].key; i = (i + 1) & mask) {
+		size_t home = map_index(map, map->entries[i].key);
+
+		if(((i - home) & mask) >= ((i - hole) & mask)) {
+			map->entries[hole] = map->entries[i];
+			hole = i;
+		}
+	}
+
+	map->entries[hole].key = 0;
+	map->entries[hole].value = NULL;
+	map->count--;
+}
+
+
+// returns the value previously stored for key
+static void *map_put(address_map *map, uint64_t key, void *value) {
+	if(!value) {
+		void *old = map_get(map, key);
+		map_remove(map, key);
+		return old;
+	}
+
+	if((map->count + 1) * 4 > map->capacity * 3) {
+		address_map grown = { NULL, map->capacity ? map->capacity * 2 : 1024, 0 };
+		grown.entries = calloc(grown.capacity, sizeof(map_entry));
+
+		if(!grown.entries)
+			out_of_memory();
+
+		for(size_t i = 0; i < map->capacity; i++) {
+			if(map->entries[i].key)
+				map_put(&grown, map->entries[i].key, map->entries[i].value);
+		}
+
+		free(map->entries);
+		*map = grown;
+	}
+
+	size_t i = map_index(map, key);
+
+	while(map->entries[i].key && map->entries[i].key != key)
+		i = (i + 1) & (map->capacity - 1);
+
+	void *old = map->entries[i].value;
+
+	if(!map->entries[i].key)
+		map->count++;
+
+	map->entries[i].key = key;
+	map->entries[i].value = value;
+	return old;
+}
+
+
+static uint64_t read_uint(replay *r) {
+	uint64_t value = 0;
+	int shift = 0;
+
+	while(r->pos < r->end) {
+		unsigned char byte = *r->pos++;
+		value |= (uint64_t)(byte & 0x7f) << shift;
+
+		if(!(byte & 0x80))
+			return value;
+
+		shift += 7;
+	}
+
+	r->error = TRUE;
+	return 0;
+}
+
+
+static void begin_frame(replay *r) {
+	replay_frame *frame = calloc(1, sizeof(replay_frame));
+
+	if(!frame)
+		out_of_memory();
+
+	frame->parent = r->frame;
+	r->frame = frame;
+	alloc_begin(&frame->frame, "replay", 0);
+}
+
+
+// call after alloc_end or alloc_return has released the frame's alloc_ptrs
+static void free_frame(replay *r) {
+	replay_frame *frame = r->frame;
+
+	while(frame->undo_count > 0) {
+		map_entry *undo = &frame->undo[--frame->undo_count];
+		map_put(&r->slots, undo->key, undo->value);
+	}
+
+	while(frame->chunks) {
+		slot_chunk *next = frame->chunks->next;
+		free(frame->chunks);
+		frame->chunks = next;
+	}
+
+	r->frame = frame->parent;
+	free(frame->undo);
+	free(frame);
+}
+
+
+static alloc_ptr *new_slot(replay *r, replay_frame *frame, uint64_t address) {
+	if(!frame->chunks || frame->chunks->used == SLOTS_PER_CHUNK) {
+		slot_chunk *chunk = calloc(1, sizeof(slot_chunk));
+
+		if(!chunk)
+			out_of_memory();
+
+		chunk->next = frame->chunks;
+		frame->chunks = chunk;
+	}
+
+	if(frame->undo_count == frame->undo_capacity) {
+		frame->undo_capacity = frame->undo_capacity ? frame->undo_capacity * 2 : 16;
+		frame->undo = realloc(frame->undo, frame->undo_capacity * sizeof(map_entry));
+
+		if(!frame->undo)
+			out_of_memory();
+	}
+
+	alloc_ptr *ptr = &frame->chunks->slots[frame->chunks->used++].ptr;
+	map_entry *undo = &frame->undo[frame->undo_count++];
+
+	undo->key = address;
+	undo->value = map_put(&r->slots, address, ptr);
+	return ptr;
+}
+
+
+static alloc_ptr *read_ref(replay *r, replay_frame *owner, BOOL fresh) {
+	uint64_t address;
+	alloc_ptr node_ptr = { 0 };
+
+	switch(read_uint(r)) {
+	case RECORD_REF_NULL:
+		return NULL;
+
+	case RECORD_REF_NODE:
+		node_ptr.node = map_get(&r->nodes, read_uint(r));
+		address = read_uint(r);
+
+		if(!node_ptr.node || address + sizeof(alloc_ptr) > alloc_size(&node_ptr)) {
+			r->error = TRUE;
+			return NULL;
+		}
+
+		return (alloc_ptr*)((char*)alloc_data(&node_ptr) + address);
+
+	case RECORD_REF_RETURN: {
+		replay_frame *frame = r->frame;
+
+		for(uint64_t depth = read_uint(r); depth > 0 && frame != r->root; depth--)
+			frame = frame->parent;
+
+		return &frame->frame.return_value.ptr;
+	}
+
+	case RECORD_REF_OTHER: {
+		address = read_uint(r);
+		alloc_root *root = map_get(&r->roots, address);
+
+		// a root that is not linked is no longer there
+		if(root && root->ptr.next)
+			return &root->ptr;
+
+		alloc_ptr *ptr = fresh ? NULL : map_get(&r->slots, address);
+		return ptr ? ptr : new_slot(r, owner, address);
+	}
+
+	default:
+		r->error = TRUE;
+		return NULL;
+	}
+}
+
+
+// The library and the array templates write alloc_ptr::node directly in a few
+// places, so each recorded pointer carries the node it held at the time.
+static void sync_ptr(replay *r, alloc_ptr *ptr, uint64_t node) {
+	if(ptr)
+		ptr->node = node ? map_get(&r->nodes, node) : NULL;
+}
+
+
+static void map_node(replay *r, uint64_t recorded, struct alloc_node *node) {
+	if(recorded && node)
+		map_put(&r->nodes, recorded, node);
+}
+
+
+// the layout carried by the typed records, which the nodes made with it point to
+static const alloc_type *read_type(replay *r) {
+	uint64_t stride = read_uint(r);
+	uint64_t ptr_count = read_uint(r);
+
+	if(r->error || stride == 0 || stride > SIZE_MAX / 2 || ptr_count > stride / sizeof(alloc_ptr)) {
+		r->error = TRUE;
+		return NULL;
+	}
+
+	alloc_type *type = malloc(sizeof(alloc_type) + (size_t)ptr_count * sizeof(size_t));
+
+	if(!type)
+		out_of_memory();
+
+	size_t *ptr_offsets = (size_t*)(type + 1);
+	type->stride = (size_t)stride;
+	type->ptr_count = (size_t)ptr_count;
+	type->ptr_offsets = ptr_offsets;
+
+	for(size_t i = 0; i < type->ptr_count; i++) {
+		uint64_t offset = read_uint(r);
+
+		if(offset % sizeof(void*) != 0 || offset > stride - sizeof(alloc_ptr)
+			|| (i > 0 && offset < ptr_offsets[i - 1] + sizeof(alloc_ptr)))
+			r->error = TRUE;
+
+		ptr_offsets[i] = (size_t)offset;
+	}
+
+	if(r->error) {
+		free(type);
+		return NULL;
+	}
+
+	for(size_t i = 0; i < r->type_count; i++) {
+		alloc_type *known = r->types[i];
+
+		if(known->stride == type->stride && known->ptr_count == type->ptr_count
+			&& memcmp(known->ptr_offsets, ptr_offsets, type->ptr_count * sizeof(size_t)) == 0) {
+			free(type);
+			return known;
+		}
+	}
+
+	alloc_type **types = realloc(r->types, (r->type_count + 1) * sizeof *types);
+
+	if(!types)
+		out_of_memory();
+
+	r->types = types;
+	r->types[r->type_count++] = type;
+	return type;
+}
+
+
+// the root at the address a RECORD_REF_OTHER gives, made if there is none
+static alloc_root *read_root(replay *r) {
+	if(read_uint(r) != RECORD_REF_OTHER) {
+		r->error = TRUE;
+		return NULL;
+	}
+
+	uint64_t address = read_uint(r);
+	alloc_root *root = map_get(&r->roots, address);
+
+	if(!root && !r->error) {
+		root = calloc(1, sizeof(alloc_root));
+
+		if(!root)
+			out_of_memory();
+
+		map_put(&r->roots, address, root);
+	}
+
+	return root;
+}
+
+
+static void replay_assign(replay *r, BOOL global) {
+	alloc_ptr *to_ptr = read_ref(r, global ? r->root : r->frame, FALSE);
+	uint64_t to_node = read_uint(r);
+	BOOL linked = (BOOL)read_uint(r);
+	alloc_ptr *from_ptr = read_ref(r, r->frame, FALSE);
+	uint64_t from_node = read_uint(r);
+
+	if(r->error || !to_ptr)
+		return;
+
+	sync_ptr(r, to_ptr, to_node);
+	sync_ptr(r, from_ptr, from_node);
+
+	if(!linked)
+		to_ptr->next = NULL;
+
+	if(global)
+		alloc_global_assign(to_ptr, from_ptr);
+	else
+		alloc_assign(to_ptr, from_ptr);
+}
+
+
+static double now_seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char **argv) {
+	if(argc != 2) {
+		fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+		return 2;
+	}
+
+	FILE *file = fopen(argv[1], "rb");
+
+	if(!file) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	unsigned char *trace = malloc(file_size > 0 ? (size_t)file_size : 1);
+
+	if(!trace)
+		out_of_memory();
+
+	if(file_size < ALLOC_RECORD_MAGIC_SIZE || fread(trace, 1, (size_t)file_size, file) != (size_t)file_size
+			|| memcmp(trace, ALLOC_RECORD_MAGIC, ALLOC_RECORD_MAGIC_SIZE) != 0) {
+		fprintf(stderr, "%s: not an allocation trace\n", argv[1]);
+		return 1;
+	}
+
+	fclose(file);
+
+	replay r = { 0 };
+	r.pos = trace + ALLOC_RECORD_MAGIC_SIZE;
+	r.end = trace + file_size;
+
+	size_t ops = 0;
+	size_t gc_count = 0;
+	double gc_total = 0;
+	double gc_max = 0;
+	size_t peak_usage = 0;
+
+	begin_frame(&r);
+	r.root = r.frame;
+
+	double start = now_seconds();
+
+	while(r.pos < r.end && !r.error) {
+		uint64_t op = read_uint(&r);
+		uint64_t size, node;
+		alloc_ptr *ptr;
+
+		switch(op) {
+		case RECORD_BEGIN:
+			begin_frame(&r);
+			break;
+
+		case RECORD_END:
+			if(r.frame != r.root) {
+				alloc_end();
+				free_frame(&r);
+			}
+			break;
+
+		case RECORD_RETURN:
+			ptr = read_ref(&r, r.frame, FALSE);
+			node = read_uint(&r);
+			size = read_uint(&r);
+
+			if(r.frame != r.root && ptr && size <= sizeof(replay_slot)) {
+				sync_ptr(&r, ptr, node);
+				alloc_return(ptr, (size_t)size);
+				free_frame(&r);
+			}
+			break;
+
+		case RECORD_RETURN_NEW:
+			size = read_uint(&r);
+			node = read_uint(&r);
+			ptr = alloc_return_new((size_t)size);
+			map_node(&r, node, ptr ? ptr->node : NULL);
+			break;
+
+		case RECORD_NEW:
+			size = read_uint(&r);
+			node = read_uint(&r);
+			map_node(&r, node, alloc_new((size_t)size));
+			break;
+
+		case RECORD_NEW_TYPED: {
+			const alloc_type *type = read_type(&r);
+			size = read_uint(&r);
+			node = read_uint(&r);
+
+			if(type && size % type->stride == 0)
+				map_node(&r, node, alloc_new_typed(type, (size_t)size));
+			else
+				r.error = TRUE;
+			break;
+		}
+
+		case RECORD_RETURN_NEW_TYPED: {
+			const alloc_type *type = read_type(&r);
+			size = read_uint(&r);
+			node = read_uint(&r);
+
+			if(type && size % type->stride == 0) {
+				ptr = alloc_return_new_typed(type, (size_t)size);
+				map_node(&r, node, ptr->node);
+			} else {
+				r.error = TRUE;
+			}
+			break;
+		}
+
+		case RECORD_RESIZE: {
+			struct alloc_node *old_node = NULL;
+
+			if((node = read_uint(&r)))
+				old_node = map_get(&r.nodes, node);
+
+			size = read_uint(&r);
+			node = read_uint(&r);
+			map_node(&r, node, alloc_resize(old_node, (size_t)size));
+			break;
+		}
+
+		case RECORD_INIT:
+			ptr = read_ref(&r, r.frame, TRUE);
+			size = read_uint(&r);
+			node = read_uint(&r);
+
+			if(ptr) {
+				alloc_init(ptr, (size_t)size);
+				map_node(&r, node, ptr->node);
+			}
+			break;
+
+		case RECORD_INIT_TYPED: {
+			ptr = read_ref(&r, r.frame, TRUE);
+			const alloc_type *type = read_type(&r);
+			size = read_uint(&r);
+			node = read_uint(&r);
+
+			if(ptr && type && size % type->stride == 0) {
+				alloc_init_typed(ptr, type, (size_t)size);
+				map_node(&r, node, ptr->node);
+			} else {
+				r.error = TRUE;
+			}
+			break;
+		}
+
+		case RECORD_ASSIGN:
+		case RECORD_GLOBAL_ASSIGN:
+			replay_assign(&r, op == RECORD_GLOBAL_ASSIGN);
+			break;
+
+		case RECORD_GC: {
+			double gc_start = now_seconds();
+			alloc_gc();
+			double pause = now_seconds() - gc_start;
+
+			gc_count++;
+			gc_total += pause;
+			if(pause > gc_max)
+				gc_max = pause;
+			break;
+		}
+
+		case RECORD_SET_MAX_MEMORY:
+			alloc_set_max_memory_usage((size_t)read_uint(&r));
+			break;
+
+		case RECORD_SET_MMAP_THRESHOLD:
+			alloc_set_mmap_threshold((size_t)read_uint(&r));
+			break;
+
+		case RECORD_UNSHARE: {
+			ptr = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, ptr, read_uint(&r));
+
+			uint64_t offset = read_uint(&r);
+			size = read_uint(&r);
+			uint64_t new_size = read_uint(&r);
+			node = read_uint(&r);
+
+			if(ptr && ptr->node && offset + size <= alloc_size(ptr))
+				map_node(&r, node, alloc_unshare(ptr, (size_t)offset, (size_t)size, (size_t)new_size));
+			break;
+		}
+
+		case RECORD_MOVE: {
+			ptr = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, ptr, read_uint(&r));
+
+			uint64_t to_pos = read_uint(&r);
+			uint64_t from_pos = read_uint(&r);
+			size = read_uint(&r);
+
+			if(ptr && ptr->node && to_pos + size <= alloc_size(ptr) && from_pos + size <= alloc_size(ptr))
+				alloc_move(ptr, (size_t)to_pos, (size_t)from_pos, (size_t)size);
+			break;
+		}
+
+		case RECORD_CLEAR: {
+			ptr = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, ptr, read_uint(&r));
+
+			uint64_t pos = read_uint(&r);
+			size = read_uint(&r);
+
+			if(ptr && pos + size <= alloc_size(ptr))
+				alloc_clear(ptr, (size_t)pos, (size_t)size);
+			break;
+		}
+
+		case RECORD_DETACH_PTRS:
+			ptr = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, ptr, read_uint(&r));
+
+			if(ptr && ptr->node)
+				alloc_detach_ptrs(ptr);
+			break;
+
+		case RECORD_ATTACH_PTR: {
+			ptr = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, ptr, read_uint(&r));
+
+			alloc_ptr *contained = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, contained, read_uint(&r));
+
+			char *data = ptr ? alloc_data(ptr) : NULL;
+
+			if(data && (char*)contained >= data && (char*)(contained + 1) <= data + alloc_size(ptr))
+				alloc_attach_ptr(ptr, contained);
+			break;
+		}
+
+		case RECORD_INTERN: {
+			ptr = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, ptr, read_uint(&r));
+			size = read_uint(&r);
+
+			if(r.error || size > (uint64_t)(r.end - r.pos)) {
+				r.error = TRUE;
+				break;
+			}
+
+			const unsigned char *bytes = r.pos;
+			r.pos += size;
+			node = read_uint(&r);
+
+			if(ptr) {
+				alloc_intern(ptr, bytes, (size_t)size);
+				map_node(&r, node, ptr->node);
+			}
+			break;
+		}
+
+		case RECORD_LINK_ROOT: {
+			alloc_root *root = read_root(&r);
+			node = read_uint(&r);
+
+			if(root && !root->ptr.next) {
+				sync_ptr(&r, &root->ptr, node);
+				alloc_link_root(root);
+			} else {
+				r.error = TRUE;
+			}
+			break;
+		}
+
+		case RECORD_UNLINK_ROOT: {
+			alloc_root *root = read_root(&r);
+			node = read_uint(&r);
+
+			if(root && root->ptr.next) {
+				sync_ptr(&r, &root->ptr, node);
+				alloc_unlink_root(root);
+			} else {
+				r.error = TRUE;
+			}
+			break;
+		}
+
+		case RECORD_SET_NODE:
+			ptr = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, ptr, read_uint(&r));
+			break;
+
+		case RECORD_KEEP_ZEROED:
+			ptr = read_ref(&r, r.frame, FALSE);
+			sync_ptr(&r, ptr, read_uint(&r));
+
+			if(ptr && ptr->node)
+				alloc_keep_zeroed(ptr);
+			else
+				r.error = TRUE;
+			break;
+
+		case RECORD_ASSIGN_ROOT: {
+			alloc_root *root = read_root(&r);
+			node = read_uint(&r);
+			ptr = read_ref(&r, r.frame, FALSE);
+			uint64_t from_node = read_uint(&r);
+
+			if(root && root->ptr.next) {
+				sync_ptr(&r, &root->ptr, node);
+				sync_ptr(&r, ptr, from_node);
+				alloc_assign_root(root, ptr);
+			} else {
+				r.error = TRUE;
+			}
+			break;
+		}
+
+		case RECORD_MOVE_ROOT: {
+			alloc_root *to = read_root(&r);
+			alloc_root *from = read_root(&r);
+			node = read_uint(&r);
+
+			if(to && from && to != from && !to->ptr.next && from->ptr.next) {
+				to->ptr.node = NULL;
+				sync_ptr(&r, &from->ptr, node);
+				alloc_move_root(to, from);
+			} else {
+				r.error = TRUE;
+			}
+			break;
+		}
+
+		default:
+			r.error = TRUE;
+			break;
+		}
+
+		if(alloc_memory_usage() > peak_usage)
+			peak_usage = alloc_memory_usage();
+
+		ops++;
+	}
+
+	double elapsed = now_seconds() - start;
+
+	while(r.frame != r.root) {
+		alloc_end();
+		free_frame(&r);
+	}
+
+	alloc_end();
+	free_frame(&r);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	if(r.error)
+		fprintf(stderr, "%s: malformed record after %lu operations\n", argv[1], (unsigned long)ops);
+
+	printf("operations:        %lu\n", (unsigned long)ops);
+	printf("elapsed:           %.6f s\n", elapsed);
+	printf("throughput:        %.0f ops/s\n", elapsed > 0 ? ops / elapsed : 0.0);
+	printf("peak memory_usage: %lu bytes\n", (unsigned long)peak_usage);
+	printf("alloc_gc calls:    %lu (total %.6f s, max %.6f s)\n", (unsigned long)gc_count, gc_total, gc_max);
+	printf("limit collections: %lu (not timed)\n", (unsigned long)(alloc_gc_count() - gc_count));
+	printf("peak RSS:          %ld KiB\n", (long)usage.ru_maxrss);
+
+	for(size_t i = 0; i < r.roots.capacity; i++) {
+		alloc_root *root = r.roots.entries[i].value;
+
+		if(root && root->ptr.next)
+			alloc_unlink_root(root);
+
+		free(root);
+	}
+
+	for(size_t i = 0; i < r.type_count; i++)
+		free(r.types[i]);
+
+	free(trace);
+	free(r.types);
+	free(r.nodes.entries);
+	free(r.slots.entries);
+	free(r.roots.entries);
+	return r.error ? 1 : 0;
+}